@@ -24,21 +24,53 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <pthread.h>
+#include <string.h>
+#include <bitset>
+#include <vector>
+#include <algorithm>
 
 #include "ozw_tools.h"
 
 #define OZW_CONFIG_DIR		"/etc/openzwave"
 #define OZW_DEFAULT_DEV		"/dev/zwave"
 
+// Z-Wave node ids run from 1 to 232
+#define ZW_MAX_NODE_ID		232
+
+// Nodes this many hops or more from the controller get flagged
+#define FAR_HOPS		3
+
+#define TOPOLOGY_NONE		0
+#define TOPOLOGY_TEXT		1
+#define TOPOLOGY_DOT		2
+
+// Snapshot files are the magic, a 32-bit record count, then the
+// records, all little endian
+#define SNAP_MAGIC		"OZWSNAP1"
+#define SNAP_MAGIC_LEN		8
+#define SNAP_HEADER_LEN		(SNAP_MAGIC_LEN + 4)
+#define SNAP_RECORD_LEN		20
+
+#define SNAP_NODE		0
+#define SNAP_CLASS		1
+#define SNAP_VALUE		2
+
+#define SNAP_LISTENING		0x01
+#define SNAP_READ_ONLY		0x02
+#define SNAP_WRITE_ONLY		0x04
+
 using namespace OpenZWave;
 
 // Global configuration
-static string zwave_port = OZW_DEFAULT_DEV;
 static int verbose = 0;
 static int debug = 0;
 static list<string> nodes_to_list;
+static int topology = TOPOLOGY_NONE;
+static const char *snapshot_file = NULL;
+static const char *diff_old = NULL, *diff_new = NULL;
 
 static bool g_initFailed = false;
+static bool g_scanned = false;
 
 typedef struct {
 	uint32 m_homeId;
@@ -51,19 +83,48 @@ static pthread_mutex_t g_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 static pthread_cond_t initCond = PTHREAD_COND_INITIALIZER;
 
+typedef bitset<ZW_MAX_NODE_ID + 1> NodeSet;
+
+// One entry in a network snapshot: a node, one of its command
+// classes, or one of its values.  The key packs the same ids
+// format_znode() and format_vid() print, so sorting by key, then
+// kind, puts each node before its classes, and each class before its
+// values.
+struct SnapRecord {
+	uint64_t key;
+	uint8_t kind;
+	uint8_t flags;
+	uint8_t info[2];	// node: generic and specific type
+				// class: version
+				// value: type and genre
+	uint16_t manufacturer;	// nodes only
+	uint16_t product_type;
+	uint16_t product_id;
+};
+
+// The mesh as seen by one controller
+struct Topology {
+	uint32_t hid;
+	uint8_t controller;
+	NodeSet nodes;
+	NodeSet neighbours[ZW_MAX_NODE_ID + 1];	// as each node reports them
+	NodeSet links[ZW_MAX_NODE_ID + 1];	// reported by either end
+	int hops[ZW_MAX_NODE_ID + 1];		// -1 if unreachable
+};
+
+static NotificationDispatcher dispatcher(&g_mutex);
+
 //-----------------------------------------------------------------------------
 // <GetNodeInfo>
 // Return the NodeInfo object associated with this notification
 //-----------------------------------------------------------------------------
-NodeInfo *GetNodeInfo(Notification const *n)
+NodeInfo *GetNodeInfo(ZWaveEvent const *ev)
 {
-	uint32 const homeId = n->GetHomeId();
-	uint8 const nodeId = n->GetNodeId();
 	for (list<NodeInfo *>::iterator it = g_nodes.begin();
 	     it != g_nodes.end(); ++it) {
 		NodeInfo *nodeInfo = *it;
-		if ((nodeInfo->m_homeId == homeId)
-		    && (nodeInfo->m_nodeId == nodeId)) {
+		if ((nodeInfo->m_homeId == ev->hid)
+		    && (nodeInfo->m_nodeId == ev->nid)) {
 			return nodeInfo;
 		}
 	}
@@ -71,120 +132,90 @@ NodeInfo *GetNodeInfo(Notification const *n)
 	return NULL;
 }
 
+static bool node_order(const NodeInfo *a, const NodeInfo *b)
+{
+	if (a->m_homeId != b->m_homeId)
+		return a->m_homeId < b->m_homeId;
+	return a->m_nodeId < b->m_nodeId;
+}
+
 //-----------------------------------------------------------------------------
-// <OnNotification>
-// Callback that is triggered when a value, group or node changes
+// Notification handlers, all called with g_mutex held
 //-----------------------------------------------------------------------------
-void OnNotification(Notification const *n, void *ctx)
+static void on_debug(ZWaveEvent const *ev)
 {
-	// Must do this inside a critical section to avoid conflicts with the main thread
-	pthread_mutex_lock(&g_mutex);
-
-	if (debug > 1) {
-		Notification *nc = new Notification(*n);
-		fprintf(stderr, "DEBUG: %s %s notification\n",
-			format_znode(n->GetHomeId(), n->GetNodeId()).c_str(),
-			nc->GetAsString().c_str());
-	}
-
-	switch (n->GetType()) {
-	case Notification::Type_ValueAdded:
-		if (NodeInfo *nodeInfo = GetNodeInfo(n)) {
-			// Add the new value to our list
-			nodeInfo->m_values.
-				push_back(n->GetValueID());
-		}
-		break;
-
-	case Notification::Type_ValueRemoved:
-		if (NodeInfo *nodeInfo = GetNodeInfo(n)) {
-			// Remove the value from out list
-			for (list<ValueID>::iterator it
-				     = nodeInfo->m_values.begin();
-			     it != nodeInfo->m_values.end();
-			     ++it) {
-				if ((*it) ==
-				    n->GetValueID()) {
-					nodeInfo->m_values.
-						erase(it);
-					break;
-				}
-			}
-		}
-		break;
-
-	case Notification::Type_ValueChanged:
-		break;
-
-	case Notification::Type_Group:
-		break;
-
-	case Notification::Type_NodeAdded:
-		{
-			// Add the new node to our list
-			NodeInfo *nodeInfo = new NodeInfo();
-			nodeInfo->m_homeId = n->GetHomeId();
-			nodeInfo->m_nodeId = n->GetNodeId();
-			g_nodes.push_back(nodeInfo);
-			break;
-		}
-
-	case Notification::Type_NodeRemoved:
-		{
-			// Remove the node from our list
-			uint32 const homeId = n->GetHomeId();
-			uint8 const nodeId = n->GetNodeId();
-			for (list<NodeInfo *>::iterator it =
-			     g_nodes.begin(); it != g_nodes.end(); ++it) {
-				NodeInfo *nodeInfo = *it;
-				if ((nodeInfo->m_homeId == homeId)
-				    && (nodeInfo->m_nodeId == nodeId)) {
-					g_nodes.erase(it);
-					delete nodeInfo;
-					break;
-				}
-			}
-			break;
-		}
+	// GetAsString() isn't const, so we need our own copy
+	Notification nc(*ev->n);
 
-	case Notification::Type_NodeEvent:
-		break;
+	fprintf(stderr, "DEBUG: %s %s notification\n",
+		format_znode(ev->hid, ev->nid).c_str(),
+		nc.GetAsString().c_str());
+}
 
-	case Notification::Type_PollingDisabled:
-		break;
+static void on_value_added(ZWaveEvent const *ev)
+{
+	if (NodeInfo *nodeInfo = GetNodeInfo(ev)) {
+		// Add the new value to our list
+		nodeInfo->m_values.push_back(ev->vid);
+	}
+}
 
-	case Notification::Type_PollingEnabled:
-		break;
+static void on_value_removed(ZWaveEvent const *ev)
+{
+	if (NodeInfo *nodeInfo = GetNodeInfo(ev)) {
+		// Remove the value from out list
+		nodeInfo->m_values.remove(ev->vid);
+	}
+}
 
-	case Notification::Type_DriverReady:
-		break;
+static void on_node_added(ZWaveEvent const *ev)
+{
+	// Add the new node to our list
+	NodeInfo *nodeInfo = new NodeInfo();
+	nodeInfo->m_homeId = ev->hid;
+	nodeInfo->m_nodeId = ev->nid;
+	g_nodes.push_back(nodeInfo);
+}
 
-	case Notification::Type_DriverFailed:
-		g_initFailed = true;
-		pthread_cond_broadcast(&initCond);
-		break;
+static void on_node_removed(ZWaveEvent const *ev)
+{
+	// Remove the node from our list
+	if (NodeInfo *nodeInfo = GetNodeInfo(ev)) {
+		g_nodes.remove(nodeInfo);
+		delete nodeInfo;
+	}
+}
 
-	case Notification::Type_AwakeNodesQueried:
-	case Notification::Type_AllNodesQueried:
-	case Notification::Type_AllNodesQueriedSomeDead:
-		pthread_cond_broadcast(&initCond);
-		break;
+static void on_driver_failed(ZWaveEvent const *ev)
+{
+	g_initFailed = true;
+	pthread_cond_broadcast(&initCond);
+}
 
-	case Notification::Type_DriverReset:
-	case Notification::Type_Notification:
-	case Notification::Type_NodeNaming:
-	case Notification::Type_NodeProtocolInfo:
-	case Notification::Type_NodeQueriesComplete:
-	default:
-		break;
-	}
+static void on_scanned(ZWaveEvent const *ev)
+{
+	g_scanned = true;
+	pthread_cond_broadcast(&initCond);
+}
 
-	pthread_mutex_unlock(&g_mutex);
+static void register_handlers(void)
+{
+	// Must come first, so we see notifications before they're handled
+	if (debug > 1)
+		dispatcher.on_all(on_debug);
+
+	dispatcher.on(Notification::Type_ValueAdded, on_value_added);
+	dispatcher.on(Notification::Type_ValueRemoved, on_value_removed);
+	dispatcher.on(Notification::Type_NodeAdded, on_node_added);
+	dispatcher.on(Notification::Type_NodeRemoved, on_node_removed);
+	dispatcher.on(Notification::Type_DriverFailed, on_driver_failed);
+	dispatcher.on_scanned(on_scanned);
 }
 
 void usage(void)
 {
-	fprintf(stderr, "lsozw [-d] [-p device]\n");
+	fprintf(stderr, "lsozw [-d] [-v] [-t | -G | -o <snapshot>] " OZW_COMMON_USAGE " [-n <home-id>:<node-id>]...\n");
+	fprintf(stderr, "lsozw -x <old-snapshot> <new-snapshot>\n");
 	exit(1);
 }
 
@@ -193,7 +224,7 @@ void parse_options(int argc, char *argv[])
 	int opt;
 	string s;
 
-	while ((opt = getopt(argc, argv, "dvp:n:")) != -1) {
+	while ((opt = getopt(argc, argv, "dvn:tGo:x:" OZW_COMMON_OPTS)) != -1) {
 		switch (opt) {
 		case 'd':
 			debug++;
@@ -201,19 +232,60 @@ void parse_options(int argc, char *argv[])
 		case 'v':
 			verbose++;
 			break;
-		case 'p':
-			zwave_port = optarg;
-			break;
 		case 'n':
 			s = optarg;
 			if (!parse_znode(s, NULL, NULL))
 				usage();
 			nodes_to_list.push_back(s);
 			break;
+		case 't':
+			topology = TOPOLOGY_TEXT;
+			break;
+		case 'G':
+			topology = TOPOLOGY_DOT;
+			break;
+		case 'o':
+			snapshot_file = optarg;
+			break;
+		case 'x':
+			diff_old = optarg;
+			break;
 		default:
-			usage();
+			if (!ozw_common_option(opt, optarg))
+				usage();
 		}
 	}
+
+	if (diff_old) {
+		// The new snapshot's the one argument after -x's own
+		if (optind != (argc - 1))
+			usage();
+		diff_new = argv[optind];
+	}
+
+	if (snapshot_file && (topology != TOPOLOGY_NONE))
+		usage();
+}
+
+// Whether a node was asked for with -n, or everything was
+static bool node_wanted(uint32_t hid, uint8_t nid)
+{
+	if (nodes_to_list.empty())
+		return true;
+
+	for (list<string>::const_iterator it = nodes_to_list.begin();
+	     it != nodes_to_list.end(); it++) {
+		uint32_t xhid;
+		uint8_t xnid;
+
+		if (!parse_znode(*it, &xhid, &xnid))
+			assert(0);
+
+		if ((xhid == hid) && (xnid == nid))
+			return true;
+	}
+
+	return false;
 }
 
 void list_one_value(Manager *mgr, NodeInfo *ni, ValueID vid)
@@ -248,22 +320,8 @@ void list_one_node(Manager *mgr, NodeInfo *ni)
 	string name = mgr->GetNodeName(hid, nid);
 	int ccid;
 
-	if (!nodes_to_list.empty()) {
-		list<string>::const_iterator it;
-		for (it = nodes_to_list.begin(); it != nodes_to_list.end(); it++) {
-			uint32_t xhid;
-			uint8_t xnid;
-
-			if (!parse_znode(*it, &xhid, &xnid))
-				assert(0);
-
-			if ((xhid == hid) && (xnid == nid))
-				break;
-		}
-
-		if (it == nodes_to_list.end())
-			return;
-	}
+	if (!node_wanted(hid, nid))
+		return;
 
 	printf("%s%s %s: %s %s",
 	       controller_nid == nid ? "*" : " ",
@@ -301,6 +359,508 @@ void list_one_node(Manager *mgr, NodeInfo *ni)
 	}
 }
 
+//-----------------------------------------------------------------------------
+// <get_topology>
+// Collect every node's neighbours, and work out how many hops each
+// node is from the controller, a breadth first search done a whole
+// frontier of nodes at a time
+//-----------------------------------------------------------------------------
+static void get_topology(Manager *mgr, Topology *t)
+{
+	NodeSet frontier, reached, next;
+	int nid, i, hops;
+
+	t->controller = mgr->GetControllerNodeId(t->hid);
+
+	for (list<NodeInfo *>::const_iterator it = g_nodes.begin();
+	     it != g_nodes.end(); it++) {
+		uint8_t *neighbours;
+		uint32_t n;
+
+		if ((*it)->m_homeId != t->hid)
+			continue;
+
+		nid = (*it)->m_nodeId;
+		t->nodes.set(nid);
+
+		n = mgr->GetNodeNeighbors(t->hid, nid, &neighbours);
+		for (i = 0; i < (int)n; i++) {
+			if (neighbours[i] && (neighbours[i] <= ZW_MAX_NODE_ID))
+				t->neighbours[nid].set(neighbours[i]);
+		}
+		if (n)
+			delete[] neighbours;
+	}
+
+	// Often only one end of a link knows about it
+	for (nid = 1; nid <= ZW_MAX_NODE_ID; nid++) {
+		t->links[nid] |= t->neighbours[nid];
+		for (i = 1; i <= ZW_MAX_NODE_ID; i++)
+			if (t->neighbours[nid][i])
+				t->links[i].set(nid);
+	}
+
+	for (nid = 0; nid <= ZW_MAX_NODE_ID; nid++)
+		t->hops[nid] = -1;
+
+	frontier.set(t->controller);
+	reached = frontier;
+	t->hops[t->controller] = 0;
+
+	for (hops = 1; frontier.any(); hops++) {
+		next.reset();
+		for (nid = 1; nid <= ZW_MAX_NODE_ID; nid++)
+			if (frontier[nid])
+				next |= t->links[nid];
+		next &= ~reached;
+
+		for (nid = 1; nid <= ZW_MAX_NODE_ID; nid++)
+			if (next[nid])
+				t->hops[nid] = hops;
+
+		reached |= next;
+		frontier = next;
+	}
+}
+
+static bool is_far(Topology *t, int nid)
+{
+	return (t->hops[nid] < 0) || (t->hops[nid] >= FAR_HOPS);
+}
+
+static bool is_single(Topology *t, int nid)
+{
+	return (nid != t->controller) && (t->links[nid].count() == 1);
+}
+
+static void print_topology_text(Topology *t)
+{
+	int nid, i, nfar = 0, nsingle = 0;
+
+	printf("%08x: controller %s\n", t->hid,
+	       format_znode(t->hid, t->controller).c_str());
+
+	for (nid = 1; nid <= ZW_MAX_NODE_ID; nid++) {
+		if (!t->nodes[nid])
+			continue;
+
+		printf("%s%s ", nid == t->controller ? "*" : " ",
+		       format_znode(t->hid, nid).c_str());
+		if (t->hops[nid] < 0)
+			printf(" - hops");
+		else
+			printf("%2d hops", t->hops[nid]);
+		printf(" %3zu neighbours:", t->links[nid].count());
+
+		for (i = 1; i <= ZW_MAX_NODE_ID; i++)
+			if (t->links[nid][i])
+				printf(" %02x", i);
+
+		if (t->hops[nid] < 0)
+			printf(" [unreachable]");
+		else if (is_far(t, nid))
+			printf(" [far]");
+		if (is_single(t, nid))
+			printf(" [single neighbour]");
+		printf("\n");
+
+		nfar += is_far(t, nid);
+		nsingle += is_single(t, nid);
+	}
+
+	printf("%08x: %zu nodes, %d far or unreachable, %d with one neighbour\n",
+	       t->hid, t->nodes.count(), nfar, nsingle);
+}
+
+static void print_topology_dot(Topology *t)
+{
+	int nid, i;
+
+	for (nid = 1; nid <= ZW_MAX_NODE_ID; nid++) {
+		string name = format_znode(t->hid, nid);
+
+		if (!t->nodes[nid])
+			continue;
+
+		printf("\t\"%s\" [label=\"%s\\n", name.c_str(), name.c_str());
+		if (t->hops[nid] < 0)
+			printf("unreachable\"");
+		else
+			printf("%d hops\"", t->hops[nid]);
+		if (nid == t->controller)
+			printf(", shape=doublecircle");
+		if (is_far(t, nid) || is_single(t, nid))
+			printf(", color=red");
+		printf("];\n");
+	}
+
+	for (nid = 1; nid <= ZW_MAX_NODE_ID; nid++) {
+		for (i = nid + 1; i <= ZW_MAX_NODE_ID; i++) {
+			if (!t->links[nid][i])
+				continue;
+
+			printf("\t\"%s\" -- \"%s\"",
+			       format_znode(t->hid, nid).c_str(),
+			       format_znode(t->hid, i).c_str());
+			// Dashed if only one end reports the link
+			if (!t->neighbours[nid][i] || !t->neighbours[i][nid])
+				printf(" [style=dashed]");
+			printf(";\n");
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// <print_topology>
+// Show the mesh behind each controller, flagging nodes that are many
+// hops away, or hang off a single neighbour, as the places a repeater
+// would help.  Called with g_nodes sorted.
+//-----------------------------------------------------------------------------
+static void print_topology(Manager *mgr)
+{
+	uint32_t last_hid = 0;
+
+	if (topology == TOPOLOGY_DOT)
+		printf("graph zwave {\n");
+
+	for (list<NodeInfo *>::const_iterator it = g_nodes.begin();
+	     it != g_nodes.end(); it++) {
+		Topology *t;
+
+		if ((*it)->m_homeId == last_hid)
+			continue;
+		last_hid = (*it)->m_homeId;
+
+		t = new Topology();
+		t->hid = last_hid;
+		get_topology(mgr, t);
+
+		if (topology == TOPOLOGY_DOT)
+			print_topology_dot(t);
+		else
+			print_topology_text(t);
+
+		delete t;
+	}
+
+	if (topology == TOPOLOGY_DOT)
+		printf("}\n");
+}
+
+static bool snap_order(const SnapRecord &a, const SnapRecord &b)
+{
+	if (a.key != b.key)
+		return a.key < b.key;
+	return a.kind < b.kind;
+}
+
+static bool snap_same_id(const SnapRecord &a, const SnapRecord &b)
+{
+	return (a.key == b.key) && (a.kind == b.kind);
+}
+
+static bool snap_same(const SnapRecord &a, const SnapRecord &b)
+{
+	return snap_same_id(a, b) && (a.flags == b.flags)
+		&& (a.info[0] == b.info[0]) && (a.info[1] == b.info[1])
+		&& (a.manufacturer == b.manufacturer)
+		&& (a.product_type == b.product_type)
+		&& (a.product_id == b.product_id);
+}
+
+static uint16_t parse_id16(const string &s)
+{
+	return strtoul(s.c_str(), NULL, 16);
+}
+
+//-----------------------------------------------------------------------------
+// <get_snapshot>
+// Collect a record for each node we were asked about, its command
+// classes and its values, in order.  Called with g_nodes sorted.
+//-----------------------------------------------------------------------------
+static void get_snapshot(Manager *mgr, vector<SnapRecord> *snap)
+{
+	for (list<NodeInfo *>::const_iterator it = g_nodes.begin();
+	     it != g_nodes.end(); it++) {
+		uint32_t hid = (*it)->m_homeId;
+		uint8_t nid = (*it)->m_nodeId;
+		SnapRecord r;
+		int ccid;
+
+		if (!node_wanted(hid, nid))
+			continue;
+
+		memset(&r, 0, sizeof(r));
+		r.key = ozw_pack_value_key(hid, nid, 0, 0, 0);
+		r.kind = SNAP_NODE;
+		if (mgr->IsNodeListeningDevice(hid, nid))
+			r.flags |= SNAP_LISTENING;
+		r.info[0] = mgr->GetNodeGeneric(hid, nid);
+		r.info[1] = mgr->GetNodeSpecific(hid, nid);
+		r.manufacturer = parse_id16(mgr->GetNodeManufacturerId(hid, nid));
+		r.product_type = parse_id16(mgr->GetNodeProductType(hid, nid));
+		r.product_id = parse_id16(mgr->GetNodeProductId(hid, nid));
+		snap->push_back(r);
+
+		for (ccid = 0; ccid < 0x100; ccid++) {
+			string cname;
+			uint8_t cver;
+
+			if (!mgr->GetNodeClassInformation(hid, nid, ccid,
+							  &cname, &cver))
+				continue;
+
+			memset(&r, 0, sizeof(r));
+			r.key = ozw_pack_value_key(hid, nid, 0, ccid, 0);
+			r.kind = SNAP_CLASS;
+			r.info[0] = cver;
+			snap->push_back(r);
+		}
+
+		for (list<ValueID>::const_iterator vit = (*it)->m_values.begin();
+		     vit != (*it)->m_values.end(); vit++) {
+			memset(&r, 0, sizeof(r));
+			r.key = ozw_pack_value_key(hid, nid, vit->GetInstance(),
+						   vit->GetCommandClassId(),
+						   vit->GetIndex());
+			r.kind = SNAP_VALUE;
+			if (mgr->IsValueReadOnly(*vit))
+				r.flags |= SNAP_READ_ONLY;
+			if (mgr->IsValueWriteOnly(*vit))
+				r.flags |= SNAP_WRITE_ONLY;
+			r.info[0] = vit->GetType();
+			r.info[1] = vit->GetGenre();
+			snap->push_back(r);
+		}
+	}
+
+	// Values arrive in whatever order the node reported them
+	sort(snap->begin(), snap->end(), snap_order);
+	snap->erase(unique(snap->begin(), snap->end(), snap_same_id),
+		    snap->end());
+}
+
+static void put_le(uint8_t *p, uint64_t v, int len)
+{
+	int i;
+
+	for (i = 0; i < len; i++)
+		p[i] = v >> (8 * i);
+}
+
+static uint64_t get_le(const uint8_t *p, int len)
+{
+	uint64_t v = 0;
+	int i;
+
+	for (i = len - 1; i >= 0; i--)
+		v = (v << 8) | p[i];
+
+	return v;
+}
+
+//-----------------------------------------------------------------------------
+// <write_snapshot>
+// Write the records out in a fixed layout, so snapshots from
+// different machines compare
+//-----------------------------------------------------------------------------
+static bool write_snapshot(const char *file, const vector<SnapRecord> &snap)
+{
+	uint8_t buf[SNAP_HEADER_LEN];
+	FILE *f;
+
+	f = fopen(file, "w");
+	if (!f)
+		return false;
+
+	memcpy(buf, SNAP_MAGIC, SNAP_MAGIC_LEN);
+	put_le(buf + SNAP_MAGIC_LEN, snap.size(), 4);
+	fwrite(buf, sizeof(buf), 1, f);
+
+	for (vector<SnapRecord>::const_iterator it = snap.begin();
+	     it != snap.end(); it++) {
+		uint8_t rec[SNAP_RECORD_LEN];
+
+		put_le(rec, it->key, 8);
+		rec[8] = it->kind;
+		rec[9] = it->flags;
+		rec[10] = it->info[0];
+		rec[11] = it->info[1];
+		put_le(rec + 12, it->manufacturer, 2);
+		put_le(rec + 14, it->product_type, 2);
+		put_le(rec + 16, it->product_id, 2);
+		put_le(rec + 18, 0, 2);
+		fwrite(rec, sizeof(rec), 1, f);
+	}
+
+	if (ferror(f)) {
+		fclose(f);
+		return false;
+	}
+	return fclose(f) == 0;
+}
+
+//-----------------------------------------------------------------------------
+// <read_snapshot>
+// Load a snapshot, checking it's in order, since the diff relies on
+// that
+//-----------------------------------------------------------------------------
+static bool read_snapshot(const char *file, vector<SnapRecord> *snap)
+{
+	string text;
+	const uint8_t *p;
+	size_t count, i;
+
+	if (!read_file(file, &text)) {
+		fprintf(stderr, "Couldn't read %s\n", file);
+		return false;
+	}
+
+	p = (const uint8_t *)text.data();
+	if ((text.size() < SNAP_HEADER_LEN)
+	    || memcmp(p, SNAP_MAGIC, SNAP_MAGIC_LEN)) {
+		fprintf(stderr, "%s is not a snapshot\n", file);
+		return false;
+	}
+
+	count = get_le(p + SNAP_MAGIC_LEN, 4);
+	if (text.size() != SNAP_HEADER_LEN + count * SNAP_RECORD_LEN) {
+		fprintf(stderr, "%s is truncated\n", file);
+		return false;
+	}
+
+	snap->resize(count);
+	p += SNAP_HEADER_LEN;
+	for (i = 0; i < count; i++, p += SNAP_RECORD_LEN) {
+		SnapRecord *r = &(*snap)[i];
+
+		r->key = get_le(p, 8);
+		r->kind = p[8];
+		r->flags = p[9];
+		r->info[0] = p[10];
+		r->info[1] = p[11];
+		r->manufacturer = get_le(p + 12, 2);
+		r->product_type = get_le(p + 14, 2);
+		r->product_id = get_le(p + 16, 2);
+
+		if (i && !snap_order((*snap)[i - 1], *r)) {
+			fprintf(stderr, "%s is out of order at record %zu\n",
+				file, i);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static string snap_id(const SnapRecord &r)
+{
+	uint32_t hid = r.key >> 32;
+	uint8_t nid = r.key >> 24;
+	uint8_t ccid = r.key >> 16;
+	uint8_t instance = r.key >> 8;
+	uint8_t index = r.key;
+	string s = format_znode(hid, nid);
+	char buf[32];
+
+	switch (r.kind) {
+	case SNAP_CLASS:
+		snprintf(buf, sizeof(buf), " class 0x%02x", ccid);
+		s += buf;
+		break;
+	case SNAP_VALUE:
+		// As format_vid()
+		snprintf(buf, sizeof(buf), " %u,0x%x,%u",
+			 instance, ccid, index);
+		s += buf;
+		break;
+	}
+
+	return s;
+}
+
+static string snap_fields(const SnapRecord &r)
+{
+	char buf[128];
+
+	switch (r.kind) {
+	case SNAP_NODE:
+		snprintf(buf, sizeof(buf),
+			 "%04x:%04x:%04x generic 0x%02x specific 0x%02x%s",
+			 r.manufacturer, r.product_type, r.product_id,
+			 r.info[0], r.info[1],
+			 (r.flags & SNAP_LISTENING) ? " listening" : "");
+		break;
+	case SNAP_CLASS:
+		snprintf(buf, sizeof(buf), "v%d", r.info[0]);
+		break;
+	case SNAP_VALUE:
+		snprintf(buf, sizeof(buf), "%c%c %s %s",
+			 (r.flags & SNAP_WRITE_ONLY) ? '-' : 'R',
+			 (r.flags & SNAP_READ_ONLY) ? '-' : 'W',
+			 Value::GetGenreNameFromEnum((ValueID::ValueGenre)r.info[1]),
+			 Value::GetTypeNameFromEnum((ValueID::ValueType)r.info[0]));
+		break;
+	default:
+		snprintf(buf, sizeof(buf), "kind %d", r.kind);
+	}
+
+	return buf;
+}
+
+//-----------------------------------------------------------------------------
+// <diff_snapshots>
+// Walk both snapshots together, like merging them, reporting what's
+// only in the old one, only in the new one, or in both but changed.
+// Both are sorted, so it's a single pass.  A node that's come or gone
+// is reported on its own, not with all its classes and values.
+// Returns the number of differences.
+//-----------------------------------------------------------------------------
+static unsigned diff_snapshots(const vector<SnapRecord> &a,
+			       const vector<SnapRecord> &b)
+{
+	const uint64_t node_mask = ~0xffffffULL;
+	uint64_t gone_node = 0, new_node = 0;
+	size_t i = 0, j = 0;
+	unsigned ndiff = 0;
+
+	while ((i < a.size()) || (j < b.size())) {
+		if ((j == b.size())
+		    || ((i < a.size()) && snap_order(a[i], b[j]))) {
+			const SnapRecord &r = a[i++];
+
+			ndiff++;
+			if (r.kind == SNAP_NODE)
+				gone_node = r.key;
+			else if ((r.key & node_mask) == gone_node)
+				continue;
+			printf("- %s %s\n", snap_id(r).c_str(),
+			       snap_fields(r).c_str());
+		} else if ((i == a.size()) || snap_order(b[j], a[i])) {
+			const SnapRecord &r = b[j++];
+
+			ndiff++;
+			if (r.kind == SNAP_NODE)
+				new_node = r.key;
+			else if ((r.key & node_mask) == new_node)
+				continue;
+			printf("+ %s %s\n", snap_id(r).c_str(),
+			       snap_fields(r).c_str());
+		} else {
+			if (!snap_same(a[i], b[j])) {
+				ndiff++;
+				printf("~ %s %s -> %s\n", snap_id(a[i]).c_str(),
+				       snap_fields(a[i]).c_str(),
+				       snap_fields(b[j]).c_str());
+			}
+			i++;
+			j++;
+		}
+	}
+
+	return ndiff;
+}
+
 //-----------------------------------------------------------------------------
 // <main>
 // Create the driver and then wait
@@ -308,10 +868,23 @@ void list_one_node(Manager *mgr, NodeInfo *ni)
 int main(int argc, char *argv[])
 {
 	Manager *mgr;
+	vector<SnapRecord> snap;
 
 	parse_options(argc, argv);
 
-	mgr = ozw_setup(zwave_port, OnNotification);
+	if (diff_old) {
+		vector<SnapRecord> snap_new;
+
+		// No need to go near the network
+		if (!read_snapshot(diff_old, &snap)
+		    || !read_snapshot(diff_new, &snap_new))
+			exit(2);
+		return diff_snapshots(snap, snap_new) ? 1 : 0;
+	}
+
+	register_handlers();
+
+	mgr = ozw_setup(NotificationDispatcher::dispatch, &dispatcher);
 
 	if (debug)
 		fprintf(stderr, "Scanning ZWave network... (debug = %d)\n",
@@ -321,7 +894,8 @@ int main(int argc, char *argv[])
 	// then write out the config file.
 	// In a normal app, we would be handling notifications and building a UI for the user.
 	pthread_mutex_lock(&g_mutex);
-	pthread_cond_wait(&initCond, &g_mutex);
+	while (!g_scanned && !g_initFailed)
+		pthread_cond_wait(&initCond, &g_mutex);
 	pthread_mutex_unlock(&g_mutex);
 
 	if (debug)
@@ -338,13 +912,21 @@ int main(int argc, char *argv[])
 	}
 
 	// We don't want any more updates
-	mgr->RemoveWatcher(OnNotification, NULL);
+	ozw_remove_watcher(mgr);
 
 	pthread_mutex_lock(&g_mutex);
-	for (std::list<NodeInfo *>::const_iterator it = g_nodes.begin();
-	     it != g_nodes.end();
-	     it++) {
-		list_one_node(mgr, *it);
+	// Nodes from different controllers arrive interleaved
+	g_nodes.sort(node_order);
+	if (topology != TOPOLOGY_NONE) {
+		print_topology(mgr);
+	} else if (snapshot_file) {
+		get_snapshot(mgr, &snap);
+	} else {
+		for (std::list<NodeInfo *>::const_iterator it = g_nodes.begin();
+		     it != g_nodes.end();
+		     it++) {
+			list_one_node(mgr, *it);
+		}
 	}
 	pthread_mutex_unlock(&g_mutex);
 
@@ -352,5 +934,10 @@ int main(int argc, char *argv[])
 
 	pthread_mutex_destroy(&g_mutex);
 
+	if (snapshot_file && !write_snapshot(snapshot_file, snap)) {
+		fprintf(stderr, "Couldn't write %s\n", snapshot_file);
+		exit(1);
+	}
+
 	return 0;
 }
@@ -0,0 +1,320 @@
+//
+// mkozwcfg - Tool to generate an OpenZWave config directory pruned
+//            to the devices on our networks
+//
+// Copyright David Gibson 2015 <ozw@gibson.dropbear.id.au>
+//
+// This program is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see
+// <http://www.gnu.org/licenses/>.
+//
+// OpenZWave parses manufacturer_specific.xml, which lists every
+// device it knows of, each time it starts.  We read the network
+// configs OpenZWave has cached, note which manufacturers and products
+// actually appear, and write a config directory with a
+// manufacturer_specific.xml listing only those, and only their device
+// files.  Tools then use it with -C.  It needs regenerating when a
+// new kind of device joins the network.
+//
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <set>
+
+#include "ozw_tools.h"
+
+#define MANUFACTURER_FILE	"manufacturer_specific.xml"
+
+using namespace OpenZWave;
+
+// Global configuration
+static int verbose = 0;
+static string config_dir = OZW_CONFIG_DIR;
+static string cache_dir = OZW_CACHE_DIR;
+static string out_dir;
+
+// What's on our networks
+static set<unsigned long> used_manufacturers;
+static set<string> used_products;
+
+static void error(const char *fmt, ...)
+	__attribute__((format (printf, 1, 2)));
+
+static void error(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	fprintf(stderr, "ERROR: ");
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+
+	exit(1);
+}
+
+static void write_file(const string &path, const string &text)
+{
+	FILE *f = fopen(path.c_str(), "w");
+
+	if (!f)
+		error("Couldn't create %s: %s\n", path.c_str(), strerror(errno));
+
+	if ((fwrite(text.data(), 1, text.size(), f) != text.size())
+	    || (fclose(f) != 0))
+		error("Couldn't write %s: %s\n", path.c_str(), strerror(errno));
+}
+
+// Create a directory and any missing parents
+static void make_dirs(const string &path)
+{
+	size_t slash = 0;
+
+	while ((slash = path.find('/', slash + 1)) != string::npos)
+		mkdir(path.substr(0, slash).c_str(), 0755);
+
+	if ((mkdir(path.c_str(), 0755) != 0) && (errno != EEXIST))
+		error("Couldn't create %s: %s\n", path.c_str(), strerror(errno));
+}
+
+static void copy_file(const string &from, const string &to)
+{
+	string text;
+
+	if (!read_file(from, &text))
+		error("Couldn't read %s: %s\n", from.c_str(), strerror(errno));
+	write_file(to, text);
+
+	if (verbose)
+		printf("%s\n", to.c_str());
+}
+
+static unsigned long attr_hex(XmlTag &tag, const char *name)
+{
+	return strtoul(tag.attrs[name].c_str(), NULL, 16);
+}
+
+static string product_key(unsigned long manufacturer, XmlTag &tag)
+{
+	return stringf("%04lx:%04lx:%04lx", manufacturer,
+		       attr_hex(tag, "type"), attr_hex(tag, "id"));
+}
+
+//-----------------------------------------------------------------------------
+// <scan_network_config>
+// Note every manufacturer and product in one cached network config
+//-----------------------------------------------------------------------------
+static void scan_network_config(const string &path)
+{
+	string text;
+	size_t pos = 0;
+	XmlTag tag;
+	unsigned long manufacturer = 0;
+	bool in_manufacturer = false;
+
+	if (!read_file(path, &text))
+		error("Couldn't read %s: %s\n", path.c_str(), strerror(errno));
+
+	while (next_xml_tag(text, &pos, &tag)) {
+		if (tag.name == "Manufacturer") {
+			manufacturer = attr_hex(tag, "id");
+			in_manufacturer = !tag.empty;
+			used_manufacturers.insert(manufacturer);
+		} else if (tag.name == "/Manufacturer") {
+			in_manufacturer = false;
+		} else if (in_manufacturer && (tag.name == "Product")) {
+			used_products.insert(product_key(manufacturer, tag));
+		}
+	}
+}
+
+static void scan_cache(void)
+{
+	DIR *dir = opendir(cache_dir.c_str());
+	struct dirent *de;
+	int n = 0;
+
+	if (!dir)
+		error("Couldn't open %s: %s\n", cache_dir.c_str(),
+		      strerror(errno));
+
+	while ((de = readdir(dir)) != NULL) {
+		size_t len = strlen(de->d_name);
+
+		if ((strncmp(de->d_name, "zwcfg_", 6) != 0) || (len < 4)
+		    || (strcmp(de->d_name + len - 4, ".xml") != 0))
+			continue;
+
+		scan_network_config(cache_dir + "/" + de->d_name);
+		n++;
+	}
+	closedir(dir);
+
+	if (!n)
+		error("No network configs in %s, run another tool first\n",
+		      cache_dir.c_str());
+}
+
+//-----------------------------------------------------------------------------
+// <prune_manufacturers>
+// Write a manufacturer_specific.xml with only the manufacturers and
+// products we saw, and copy the device files those products use
+//-----------------------------------------------------------------------------
+static void prune_manufacturers(int *nproducts, int *nfiles)
+{
+	string text, out;
+	size_t pos = 0;
+	XmlTag tag;
+	unsigned long manufacturer = 0;
+	bool started = false, keep = false;
+	set<string> files;
+
+	if (!read_file(config_dir + "/" MANUFACTURER_FILE, &text))
+		error("Couldn't read %s/" MANUFACTURER_FILE ": %s\n",
+		      config_dir.c_str(), strerror(errno));
+
+	*nproducts = 0;
+	while (next_xml_tag(text, &pos, &tag)) {
+		if (tag.name == "Manufacturer") {
+			// Everything before the first manufacturer, the
+			// declaration and root element, goes in as is
+			if (!started)
+				out = text.substr(0, text.rfind('\n', tag.start)
+						  + 1);
+			started = true;
+
+			manufacturer = attr_hex(tag, "id");
+			keep = used_manufacturers.count(manufacturer);
+			if (keep)
+				out += "\t" + text.substr(tag.start,
+							  tag.end - tag.start)
+					+ "\n";
+			if (keep && tag.empty)
+				keep = false;
+		} else if (tag.name == "/Manufacturer") {
+			if (keep)
+				out += "\t</Manufacturer>\n";
+			keep = false;
+		} else if (keep && (tag.name == "Product")) {
+			if (!used_products.count(product_key(manufacturer, tag)))
+				continue;
+
+			out += "\t\t" + text.substr(tag.start,
+						    tag.end - tag.start) + "\n";
+			(*nproducts)++;
+			if (!tag.attrs["config"].empty())
+				files.insert(tag.attrs["config"]);
+		} else if (tag.name == "/ManufacturerSpecificData") {
+			out += text.substr(tag.start, tag.end - tag.start)
+				+ "\n";
+		}
+	}
+
+	write_file(out_dir + "/" MANUFACTURER_FILE, out);
+	if (verbose)
+		printf("%s/" MANUFACTURER_FILE "\n", out_dir.c_str());
+
+	for (set<string>::iterator it = files.begin(); it != files.end(); it++) {
+		size_t slash = it->rfind('/');
+
+		if (slash != string::npos)
+			make_dirs(out_dir + "/" + it->substr(0, slash));
+		copy_file(config_dir + "/" + *it, out_dir + "/" + *it);
+	}
+	*nfiles = files.size();
+}
+
+//-----------------------------------------------------------------------------
+// <copy_common_files>
+// Everything else at the top level (device classes, options and so
+// on) is small and needed whatever the network, so comes over as is
+//-----------------------------------------------------------------------------
+static void copy_common_files(void)
+{
+	DIR *dir = opendir(config_dir.c_str());
+	struct dirent *de;
+
+	if (!dir)
+		error("Couldn't open %s: %s\n", config_dir.c_str(),
+		      strerror(errno));
+
+	while ((de = readdir(dir)) != NULL) {
+		string path = config_dir + "/" + de->d_name;
+		struct stat st;
+
+		if ((stat(path.c_str(), &st) != 0) || !S_ISREG(st.st_mode)
+		    || (strcmp(de->d_name, MANUFACTURER_FILE) == 0))
+			continue;
+
+		copy_file(path, out_dir + "/" + de->d_name);
+	}
+	closedir(dir);
+}
+
+void usage(void)
+{
+	fprintf(stderr, "mkozwcfg [-v] [-C config dir] [-c cache dir] <output dir>\n");
+	exit(1);
+}
+
+void parse_options(int argc, char *argv[])
+{
+	int opt;
+
+	while ((opt = getopt(argc, argv, "vC:c:")) != -1) {
+		switch (opt) {
+		case 'v':
+			verbose++;
+			break;
+		case 'C':
+			config_dir = optarg;
+			break;
+		case 'c':
+			cache_dir = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (argc != optind + 1)
+		usage();
+
+	out_dir = argv[optind];
+}
+
+//-----------------------------------------------------------------------------
+// <main>
+//-----------------------------------------------------------------------------
+int main(int argc, char *argv[])
+{
+	int nproducts, nfiles;
+
+	parse_options(argc, argv);
+
+	scan_cache();
+
+	make_dirs(out_dir);
+	copy_common_files();
+	prune_manufacturers(&nproducts, &nfiles);
+
+	printf("%zu manufacturers, %d of %zu products, %d device files\n",
+	       used_manufacturers.size(), nproducts, used_products.size(),
+	       nfiles);
+
+	exit(0);
+}
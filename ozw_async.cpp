@@ -0,0 +1,409 @@
+//
+// ozw_async - Coroutine layer over the notification stream
+//
+// Copyright David Gibson 2015 <ozw@gibson.dropbear.id.au>
+//
+// This program is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see
+// <http://www.gnu.org/licenses/>.
+//
+// Tools used to wait for things with a condition variable and a flag
+// for each, which gets out of hand as soon as you want to wait for
+// several things at once.  Here a tool instead writes a coroutine
+// for each thing it's doing, and each co_awaits the events it needs.
+// Notification handlers just note what happened and mark the waiting
+// coroutines ready; they're resumed one at a time, on the thread
+// running ozw_async_run(), which also looks after timeouts.
+//
+#include <pthread.h>
+#include <errno.h>
+#include <time.h>
+#include <deque>
+
+#include "ozw_tools.h"
+
+using namespace OpenZWave;
+
+static pthread_once_t async_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t async_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t async_cond;
+
+static list<AsyncWait *> waiters;
+static deque<std::coroutine_handle<> > ready;
+static int live_tasks;
+
+// Every value we know of, and how many times it's been updated
+static map<ValueID, uint64_t> values;
+// The same values by ozw_value_key(), so a matcher's found directly
+static map<uint64_t, ValueID> by_key;
+static bool scanned;
+static bool failed;
+
+static void async_init(void)
+{
+	pthread_condattr_t attr;
+
+	// Deadlines come from ozw_now_ns()
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&async_cond, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
+//-----------------------------------------------------------------------------
+// <async_check>
+// See if a wait is over, and if so set its result.  Called with
+// async_mutex held.
+//-----------------------------------------------------------------------------
+static bool async_check(AsyncWait *w, uint64_t now)
+{
+	map<ValueID, uint64_t>::iterator it;
+	map<uint64_t, ValueID>::iterator kt;
+
+	if (w->cancel && w->cancel->cancelled) {
+		w->status = ASYNC_CANCELLED;
+		return true;
+	}
+
+	if (failed) {
+		w->status = ASYNC_FAILED;
+		return true;
+	}
+
+	switch (w->kind) {
+	case AsyncWait::SCAN:
+		if (scanned) {
+			w->status = ASYNC_OK;
+			return true;
+		}
+		break;
+
+	case AsyncWait::ADDED:
+		kt = by_key.find(w->matcher->key());
+		if (kt != by_key.end()) {
+			*w->vidp = kt->second;
+			w->status = ASYNC_OK;
+			return true;
+		}
+		if (scanned) {
+			w->status = ASYNC_NOTFOUND;
+			return true;
+		}
+		break;
+
+	case AsyncWait::CHANGED:
+		it = values.find(w->vid);
+		if (it == values.end()) {
+			w->status = ASYNC_REMOVED;
+			return true;
+		}
+		if (it->second != *w->seq) {
+			*w->seq = it->second;
+			w->status = ASYNC_OK;
+			return true;
+		}
+		break;
+
+	case AsyncWait::SLEEP:
+		if (w->deadline && (now >= w->deadline)) {
+			w->status = ASYNC_OK;
+			return true;
+		}
+		break;
+	}
+
+	if (w->deadline && (now >= w->deadline)) {
+		w->status = ASYNC_TIMEOUT;
+		return true;
+	}
+
+	return false;
+}
+
+// Called with async_mutex held
+static void wake_waiters(void)
+{
+	uint64_t now = ozw_now_ns();
+	list<AsyncWait *>::iterator it = waiters.begin();
+
+	while (it != waiters.end()) {
+		if (async_check(*it, now)) {
+			ready.push_back((*it)->handle);
+			it = waiters.erase(it);
+		} else {
+			it++;
+		}
+	}
+
+	if (!ready.empty())
+		pthread_cond_signal(&async_cond);
+}
+
+AsyncWait::AsyncWait(int kind, uint64_t timeout_ns, AsyncCancel *cancel)
+	: kind(kind), matcher(NULL), vid(0, (uint64)0), vidp(NULL), seq(NULL),
+	  deadline(timeout_ns ? ozw_now_ns() + timeout_ns : 0),
+	  cancel(cancel), status(ASYNC_OK)
+{
+}
+
+bool AsyncWait::await_suspend(std::coroutine_handle<> h)
+{
+	bool suspend = false;
+
+	pthread_mutex_lock(&async_mutex);
+	handle = h;
+	if (!async_check(this, ozw_now_ns())) {
+		waiters.push_back(this);
+		suspend = true;
+	}
+	pthread_mutex_unlock(&async_mutex);
+
+	return suspend;
+}
+
+AsyncTask::promise_type::~promise_type()
+{
+	pthread_mutex_lock(&async_mutex);
+	live_tasks--;
+	pthread_mutex_unlock(&async_mutex);
+}
+
+//-----------------------------------------------------------------------------
+// Notification handlers
+//-----------------------------------------------------------------------------
+static void on_value_added(ZWaveEvent const *ev)
+{
+	pthread_mutex_lock(&async_mutex);
+	values.insert(make_pair(ev->vid, (uint64_t)0));
+	by_key.insert(make_pair(ozw_value_key(ev->vid), ev->vid));
+	// A warm start finishes with the last cached value
+	if (!scanned && ozw_all_scanned())
+		scanned = true;
+	wake_waiters();
+	pthread_mutex_unlock(&async_mutex);
+}
+
+// Called with async_mutex held
+static void forget_value(ValueID const &vid)
+{
+	map<uint64_t, ValueID>::iterator kt = by_key.find(ozw_value_key(vid));
+
+	if ((kt != by_key.end()) && (kt->second == vid))
+		by_key.erase(kt);
+	values.erase(vid);
+}
+
+static void on_value_removed(ZWaveEvent const *ev)
+{
+	pthread_mutex_lock(&async_mutex);
+	forget_value(ev->vid);
+	wake_waiters();
+	pthread_mutex_unlock(&async_mutex);
+}
+
+static void on_node_removed(ZWaveEvent const *ev)
+{
+	map<ValueID, uint64_t>::iterator it;
+
+	pthread_mutex_lock(&async_mutex);
+	it = values.begin();
+	while (it != values.end()) {
+		if ((it->first.GetHomeId() == ev->hid)
+		    && (it->first.GetNodeId() == ev->nid)) {
+			ValueID vid = (it++)->first;
+
+			forget_value(vid);
+		} else {
+			it++;
+		}
+	}
+	wake_waiters();
+	pthread_mutex_unlock(&async_mutex);
+}
+
+static void on_value_changed(ZWaveEvent const *ev)
+{
+	map<ValueID, uint64_t>::iterator it;
+
+	pthread_mutex_lock(&async_mutex);
+	it = values.find(ev->vid);
+	if (it != values.end()) {
+		it->second++;
+		wake_waiters();
+	}
+	pthread_mutex_unlock(&async_mutex);
+}
+
+static void on_driver_failed(ZWaveEvent const *ev)
+{
+	pthread_mutex_lock(&async_mutex);
+	failed = true;
+	wake_waiters();
+	pthread_mutex_unlock(&async_mutex);
+}
+
+static void on_scanned(ZWaveEvent const *ev)
+{
+	if (!ozw_all_scanned())
+		return;
+
+	pthread_mutex_lock(&async_mutex);
+	scanned = true;
+	wake_waiters();
+	pthread_mutex_unlock(&async_mutex);
+}
+
+//-----------------------------------------------------------------------------
+// <ozw_async_attach>
+// Feed notifications from this dispatcher to waiting tasks.  Must be
+// called before ozw_setup(), so we see every value added.
+//-----------------------------------------------------------------------------
+void ozw_async_attach(NotificationDispatcher *d)
+{
+	pthread_once(&async_once, async_init);
+
+	d->on(Notification::Type_ValueAdded, on_value_added);
+	d->on(Notification::Type_ValueRemoved, on_value_removed);
+	d->on(Notification::Type_NodeRemoved, on_node_removed);
+	d->on(Notification::Type_ValueChanged, on_value_changed);
+	d->on(Notification::Type_ValueRefreshed, on_value_changed);
+	d->on(Notification::Type_DriverFailed, on_driver_failed);
+	d->on(Notification::Type_AwakeNodesQueried, on_scanned);
+	d->on(Notification::Type_AllNodesQueried, on_scanned);
+	d->on(Notification::Type_AllNodesQueriedSomeDead, on_scanned);
+}
+
+void ozw_async_spawn(AsyncTask task)
+{
+	pthread_mutex_lock(&async_mutex);
+	live_tasks++;
+	ready.push_back(task.handle);
+	pthread_cond_signal(&async_cond);
+	pthread_mutex_unlock(&async_mutex);
+}
+
+//-----------------------------------------------------------------------------
+// <ozw_async_run>
+// Run tasks as they become ready, until they've all finished
+//-----------------------------------------------------------------------------
+void ozw_async_run(void)
+{
+	pthread_once(&async_once, async_init);
+
+	pthread_mutex_lock(&async_mutex);
+	while (live_tasks) {
+		uint64_t next = 0;
+		struct timespec ts;
+
+		if (!ready.empty()) {
+			std::coroutine_handle<> h = ready.front();
+
+			ready.pop_front();
+			pthread_mutex_unlock(&async_mutex);
+			h.resume();
+			pthread_mutex_lock(&async_mutex);
+			continue;
+		}
+
+		for (list<AsyncWait *>::iterator it = waiters.begin();
+		     it != waiters.end(); it++) {
+			if ((*it)->deadline
+			    && (!next || ((*it)->deadline < next)))
+				next = (*it)->deadline;
+		}
+
+		if (!next) {
+			pthread_cond_wait(&async_cond, &async_mutex);
+			continue;
+		}
+
+		ts.tv_sec = next / 1000000000;
+		ts.tv_nsec = next % 1000000000;
+		if (pthread_cond_timedwait(&async_cond, &async_mutex, &ts)
+		    == ETIMEDOUT)
+			wake_waiters();
+	}
+	pthread_mutex_unlock(&async_mutex);
+}
+
+//-----------------------------------------------------------------------------
+// <ozw_async_cancel>
+// End every wait passed this token with ASYNC_CANCELLED, along with
+// any it's passed to later.  Can be called from any thread.
+//-----------------------------------------------------------------------------
+void ozw_async_cancel(AsyncCancel *cancel)
+{
+	pthread_mutex_lock(&async_mutex);
+	cancel->cancelled = true;
+	wake_waiters();
+	pthread_mutex_unlock(&async_mutex);
+}
+
+//-----------------------------------------------------------------------------
+// <ozw_value_seq>
+// Where a value's updates are up to, to start ozw_value_changed() from
+//-----------------------------------------------------------------------------
+uint64_t ozw_value_seq(ValueID const &vid)
+{
+	map<ValueID, uint64_t>::iterator it;
+	uint64_t seq = 0;
+
+	pthread_mutex_lock(&async_mutex);
+	it = values.find(vid);
+	if (it != values.end())
+		seq = it->second;
+	pthread_mutex_unlock(&async_mutex);
+
+	return seq;
+}
+
+AsyncWait ozw_scan_complete(uint64_t timeout_ns, AsyncCancel *cancel)
+{
+	return AsyncWait(AsyncWait::SCAN, timeout_ns, cancel);
+}
+
+//-----------------------------------------------------------------------------
+// <ozw_value_added>
+// Wait for a value matching matcher, giving ASYNC_NOTFOUND if the
+// scan completes without one
+//-----------------------------------------------------------------------------
+AsyncWait ozw_value_added(ValueMatcher *matcher, ValueID *vidp,
+			  uint64_t timeout_ns, AsyncCancel *cancel)
+{
+	AsyncWait w(AsyncWait::ADDED, timeout_ns, cancel);
+
+	w.matcher = matcher;
+	w.vidp = vidp;
+	return w;
+}
+
+//-----------------------------------------------------------------------------
+// <ozw_value_changed>
+// Wait for the value to be updated past *seq, which is then moved on.
+// Updates in between waits aren't lost, but several may be reported
+// as one.
+//-----------------------------------------------------------------------------
+AsyncWait ozw_value_changed(ValueID const &vid, uint64_t *seq,
+			    uint64_t timeout_ns, AsyncCancel *cancel)
+{
+	AsyncWait w(AsyncWait::CHANGED, timeout_ns, cancel);
+
+	w.vid = vid;
+	w.seq = seq;
+	return w;
+}
+
+AsyncWait ozw_sleep(uint64_t ns, AsyncCancel *cancel)
+{
+	return AsyncWait(AsyncWait::SLEEP, ns, cancel);
+}
@@ -0,0 +1,356 @@
+//
+// ozw_budget - Airtime budget for polls, with a priority lane for
+// interactive requests
+//
+// Copyright David Gibson 2015 <ozw@gibson.dropbear.id.au>
+//
+// This program is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see
+// <http://www.gnu.org/licenses/>.
+//
+// OpenZWave's own polling puts every due poll straight on the send
+// queue, so with enough values polled, anything interactive waits
+// behind a queue of polls.  Instead, tools can hand polls to us.  We
+// send them as refreshes, but only keep so many outstanding at once
+// on each controller, and on each node.  An interactive request, a
+// read or write someone's waiting on, goes straight out.  Until it's
+// answered, no more polls go out on that controller.
+//
+// The budget lives in the process that owns the controller, and only
+// one process can have the controller open, so the interactive lane
+// only covers that process's own requests: pollozw's rule actions,
+// and anything it refreshes through ozw_refresh_value().  Elsewhere
+// the budget's never enabled and ozw_budget_interactive() does
+// nothing.
+//
+// A request is answered when its value changes or is refreshed.  If
+// the node times out or is dead, or we hear nothing for
+// BUDGET_TIMEOUT seconds, we stop waiting for it.
+//
+
+#include <string.h>
+#include <deque>
+#include <set>
+
+#include "ozw_tools.h"
+
+#define BUDGET_TIMEOUT		10
+
+using namespace OpenZWave;
+
+struct Request {
+	ValueID vid;
+	uint64_t queued_ns;
+	uint64_t sent_ns;
+	bool interactive;
+};
+
+struct Budget {
+	deque<Request> queue;		// polls waiting to go out
+	set<ValueID> queued;		// what's in queue
+	map<ValueID, Request> sent;
+	unsigned polls_out;
+	unsigned interactive_out;
+	unsigned node_out[256];		// polls outstanding to each node
+
+	OzwBudgetStats stats;		// since the last sample
+};
+
+static pthread_mutex_t budget_mutex = PTHREAD_MUTEX_INITIALIZER;
+static bool enabled = false;
+static unsigned max_per_controller, max_per_node;
+static Budget budgets[OZW_MAX_DRIVERS];
+
+// The notifications that can answer a request, everything else skips
+// the lock
+static const uint32_t budget_types =
+	(1U << Notification::Type_ValueChanged)
+	| (1U << Notification::Type_ValueRefreshed)
+	| (1U << Notification::Type_ValueRemoved)
+	| (1U << Notification::Type_NodeRemoved)
+	| (1U << Notification::Type_Notification);
+
+static Budget *budget(uint32_t hid)
+{
+	int shard = ozw_shard(hid);
+
+	if (shard < 0)
+		return NULL;
+
+	return &budgets[shard];
+}
+
+//-----------------------------------------------------------------------------
+// <ozw_budget_init>
+// Start handling polls ourselves, allowing at most per_controller
+// outstanding on each controller, and per_node on each node
+//-----------------------------------------------------------------------------
+void ozw_budget_init(unsigned per_controller, unsigned per_node)
+{
+	max_per_controller = per_controller;
+	max_per_node = per_node;
+	enabled = true;
+}
+
+bool ozw_budget_enabled(void)
+{
+	return enabled;
+}
+
+// Called with budget_mutex held
+static void answered(Budget *b, map<ValueID, Request>::iterator it,
+		     uint64_t now)
+{
+	if (it->second.interactive) {
+		uint64_t rtt = now - it->second.sent_ns;
+
+		b->interactive_out--;
+		b->stats.interactive_ns += rtt;
+		if (rtt > b->stats.interactive_max_ns)
+			b->stats.interactive_max_ns = rtt;
+	} else {
+		b->polls_out--;
+		b->node_out[it->first.GetNodeId()]--;
+	}
+
+	b->sent.erase(it);
+}
+
+// Called with budget_mutex held
+static void expire(Budget *b, uint64_t now)
+{
+	map<ValueID, Request>::iterator it = b->sent.begin();
+
+	while (it != b->sent.end()) {
+		if ((now - it->second.sent_ns) > BUDGET_TIMEOUT * 1000000000ULL)
+			answered(b, it++, now);
+		else
+			it++;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// <next_polls>
+// Take as many polls off the queue as the budget allows, oldest
+// first, skipping those for nodes already at their limit.  Called
+// with budget_mutex held.
+//-----------------------------------------------------------------------------
+static void next_polls(Budget *b, list<ValueID> *batch)
+{
+	uint64_t now = ozw_now_ns();
+	deque<Request>::iterator it;
+
+	expire(b, now);
+
+	it = b->queue.begin();
+	while ((it != b->queue.end()) && !b->interactive_out
+	       && (b->polls_out < max_per_controller)) {
+		uint8_t nid = it->vid.GetNodeId();
+		uint64_t wait;
+
+		if (b->node_out[nid] >= max_per_node) {
+			it++;
+			continue;
+		}
+
+		wait = now - it->queued_ns;
+		b->stats.polls++;
+		b->stats.wait_ns += wait;
+		if (wait > b->stats.wait_max_ns)
+			b->stats.wait_max_ns = wait;
+
+		it->sent_ns = now;
+		b->sent.insert(make_pair(it->vid, *it));
+		b->polls_out++;
+		b->node_out[nid]++;
+		b->queued.erase(it->vid);
+		batch->push_back(it->vid);
+		it = b->queue.erase(it);
+	}
+}
+
+// Called without budget_mutex held
+static void send_polls(list<ValueID> &batch)
+{
+	Manager *mgr = Manager::Get();
+
+	for (list<ValueID>::iterator it = batch.begin();
+	     it != batch.end(); it++) {
+		if (mgr->RefreshValue(*it))
+			continue;
+
+		// Nothing's coming back, so don't wait for it
+		pthread_mutex_lock(&budget_mutex);
+		Budget *b = budget(it->GetHomeId());
+		map<ValueID, Request>::iterator st = b->sent.find(*it);
+
+		if (st != b->sent.end())
+			answered(b, st, ozw_now_ns());
+		pthread_mutex_unlock(&budget_mutex);
+	}
+}
+
+//-----------------------------------------------------------------------------
+// <ozw_budget_poll>
+// Queue a poll of a value, unless one's already queued or waiting on
+// an answer
+//-----------------------------------------------------------------------------
+void ozw_budget_poll(ValueID const &vid)
+{
+	list<ValueID> batch;
+	Budget *b;
+
+	pthread_mutex_lock(&budget_mutex);
+
+	b = budget(vid.GetHomeId());
+	if (!b || b->queued.count(vid) || b->sent.count(vid)) {
+		pthread_mutex_unlock(&budget_mutex);
+		return;
+	}
+
+	Request r = { vid, ozw_now_ns(), 0, false };
+
+	b->queue.push_back(r);
+	b->queued.insert(vid);
+	next_polls(b, &batch);
+
+	pthread_mutex_unlock(&budget_mutex);
+
+	send_polls(batch);
+}
+
+//-----------------------------------------------------------------------------
+// <ozw_budget_interactive>
+// Note that we're about to send an interactive request about a
+// value, which holds back polls on its controller until it's been
+// answered.  Call it before sending, so a poll can't slip in ahead.
+//-----------------------------------------------------------------------------
+void ozw_budget_interactive(ValueID const &vid)
+{
+	map<ValueID, Request>::iterator it;
+	Budget *b;
+
+	if (!enabled)
+		return;
+
+	pthread_mutex_lock(&budget_mutex);
+
+	b = budget(vid.GetHomeId());
+	if (b) {
+		uint64_t now = ozw_now_ns();
+		Request r = { vid, now, now, true };
+
+		// An outstanding poll of the same value will answer this
+		// too, but it's now got someone waiting on it
+		it = b->sent.find(vid);
+		if (it != b->sent.end())
+			answered(b, it, now);
+
+		b->sent.insert(make_pair(vid, r));
+		b->interactive_out++;
+		b->stats.interactive++;
+	}
+
+	pthread_mutex_unlock(&budget_mutex);
+}
+
+//-----------------------------------------------------------------------------
+// <ozw_budget_notification>
+// Pick up answers to our requests, called by the shared watcher
+// before the tool's own handler
+//-----------------------------------------------------------------------------
+void ozw_budget_notification(Notification const *n)
+{
+	int type = n->GetType();
+	list<ValueID> batch;
+	uint64_t now;
+	Budget *b;
+
+	if (!enabled || (type < 0) || (type >= OZW_NOTIFICATION_TYPES)
+	    || !(budget_types & (1U << type)))
+		return;
+	if ((type == Notification::Type_Notification)
+	    && (n->GetNotification() != Notification::Code_Timeout)
+	    && (n->GetNotification() != Notification::Code_Dead))
+		return;
+
+	pthread_mutex_lock(&budget_mutex);
+
+	b = budget(n->GetHomeId());
+	if (!b) {
+		pthread_mutex_unlock(&budget_mutex);
+		return;
+	}
+	now = ozw_now_ns();
+
+	switch (n->GetType()) {
+	case Notification::Type_ValueChanged:
+	case Notification::Type_ValueRefreshed:
+	case Notification::Type_ValueRemoved: {
+		map<ValueID, Request>::iterator it;
+
+		it = b->sent.find(n->GetValueID());
+		if (it != b->sent.end())
+			answered(b, it, now);
+		break;
+	}
+
+	case Notification::Type_Notification:
+		// A timeout or dead node, so nothing more's coming from it
+	case Notification::Type_NodeRemoved: {
+		map<ValueID, Request>::iterator it = b->sent.begin();
+
+		while (it != b->sent.end()) {
+			if (it->first.GetNodeId() == n->GetNodeId())
+				answered(b, it++, now);
+			else
+				it++;
+		}
+		break;
+	}
+
+	default:
+		break;
+	}
+
+	next_polls(b, &batch);
+
+	pthread_mutex_unlock(&budget_mutex);
+
+	send_polls(batch);
+}
+
+//-----------------------------------------------------------------------------
+// <ozw_budget_sample>
+// Get a controller's queue depth and outstanding requests, and the
+// totals since the last sample
+//-----------------------------------------------------------------------------
+void ozw_budget_sample(uint32_t hid, OzwBudgetStats *st)
+{
+	Budget *b;
+
+	memset(st, 0, sizeof(*st));
+
+	pthread_mutex_lock(&budget_mutex);
+
+	b = budget(hid);
+	if (b) {
+		*st = b->stats;
+		st->queued = b->queue.size();
+		st->polls_out = b->polls_out;
+		st->interactive_out = b->interactive_out;
+		memset(&b->stats, 0, sizeof(b->stats));
+	}
+
+	pthread_mutex_unlock(&budget_mutex);
+}
@@ -0,0 +1,154 @@
+//
+// ozw_dispatch - Typed notification dispatch
+//
+// Copyright David Gibson 2015 <ozw@gibson.dropbear.id.au>
+//
+// This program is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see
+// <http://www.gnu.org/licenses/>.
+//
+// Handlers are all registered before ozw_setup(), and never change
+// after that, so the dispatch path can read them without locking.
+// Notifications nobody registered for are thrown away on a single
+// mask test and a check against the homes and nodes registered for
+// that type, before we go anywhere near the tool's lock.
+//
+#include "ozw_tools.h"
+
+using namespace OpenZWave;
+
+NotificationDispatcher::NotificationDispatcher(pthread_mutex_t *mutex)
+	: mutex(mutex), type_mask(0), scanned_handler(NULL), scanned(false)
+{
+}
+
+void NotificationDispatcher::on(int type, handler_t handler,
+				uint32_t hid, uint8_t nid_min, uint8_t nid_max)
+{
+	TypeRange *tr;
+	Registration r;
+
+	assert((type >= 0) && (type < OZW_NOTIFICATION_TYPES));
+
+	tr = &ranges[type];
+	if (!(type_mask & (1U << type))) {
+		tr->hid = hid;
+		tr->nid_min = nid_min;
+		tr->nid_max = nid_max;
+	} else {
+		if (tr->hid != hid)
+			tr->hid = 0;
+		if (nid_min < tr->nid_min)
+			tr->nid_min = nid_min;
+		if (nid_max > tr->nid_max)
+			tr->nid_max = nid_max;
+	}
+
+	r.type = type;
+	r.handler = handler;
+	r.hid = hid;
+	r.nid_min = nid_min;
+	r.nid_max = nid_max;
+	handlers.push_back(r);
+
+	type_mask |= 1U << type;
+}
+
+void NotificationDispatcher::on_all(handler_t handler)
+{
+	int type;
+
+	for (type = 0; type < OZW_NOTIFICATION_TYPES; type++)
+		on(type, handler);
+}
+
+//-----------------------------------------------------------------------------
+// <NotificationDispatcher::on_scanned>
+// Register a handler to be called once, when every controller has
+// finished (at least) querying its awake nodes.  On a warm start
+// that's instead when the last cached value has been added.
+//-----------------------------------------------------------------------------
+void NotificationDispatcher::on_scanned(handler_t handler)
+{
+	static const int types[] = {
+		Notification::Type_AwakeNodesQueried,
+		Notification::Type_AllNodesQueried,
+		Notification::Type_AllNodesQueriedSomeDead,
+		Notification::Type_ValueAdded,
+	};
+	unsigned i;
+
+	scanned_handler = handler;
+
+	// These need to get through for every home and node
+	for (i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+		ranges[types[i]].hid = 0;
+		ranges[types[i]].nid_min = 0;
+		ranges[types[i]].nid_max = 0xff;
+		type_mask |= 1U << types[i];
+	}
+}
+
+void NotificationDispatcher::dispatch(Notification const *n, void *ctx)
+{
+	NotificationDispatcher *d = (NotificationDispatcher *)ctx;
+	int type = n->GetType();
+	TypeRange const *tr;
+	uint8_t nid;
+
+	// Early filter, no lock needed
+	if ((type < 0) || (type >= OZW_NOTIFICATION_TYPES)
+	    || !(d->type_mask & (1U << type)))
+		return;
+
+	tr = &d->ranges[type];
+	nid = n->GetNodeId();
+	if ((tr->hid && (tr->hid != n->GetHomeId()))
+	    || (nid < tr->nid_min) || (nid > tr->nid_max))
+		return;
+
+	// ValueID has no public default constructor, so build it whole
+	ZWaveEvent ev = { type, n->GetHomeId(), nid,
+			  n->GetValueID(), 0, n };
+
+	if (type == Notification::Type_Notification)
+		ev.code = n->GetNotification();
+	else if (type == Notification::Type_NodeEvent)
+		ev.code = n->GetEvent();
+
+	if (d->mutex)
+		ozw_lock(d->mutex);
+
+	for (vector<Registration>::iterator it = d->handlers.begin();
+	     it != d->handlers.end(); it++) {
+		if ((it->type != type)
+		    || (it->hid && (it->hid != ev.hid))
+		    || (ev.nid < it->nid_min) || (ev.nid > it->nid_max))
+			continue;
+
+		it->handler(&ev);
+	}
+
+	if (d->scanned_handler && !d->scanned
+	    && ((type == Notification::Type_AwakeNodesQueried)
+		|| (type == Notification::Type_AllNodesQueried)
+		|| (type == Notification::Type_AllNodesQueriedSomeDead)
+		|| (type == Notification::Type_ValueAdded))
+	    && ozw_all_scanned()) {
+		d->scanned = true;
+		d->scanned_handler(&ev);
+	}
+
+	if (d->mutex)
+		pthread_mutex_unlock(d->mutex);
+}
@@ -0,0 +1,390 @@
+//
+// ozw_log - Asynchronous OpenZWave log sink
+//
+// Copyright David Gibson 2015 <ozw@gibson.dropbear.id.au>
+//
+// This program is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see
+// <http://www.gnu.org/licenses/>.
+//
+// OpenZWave's default logger formats and writes every message to
+// OZW_Log.txt synchronously, from whichever thread logged it -
+// including the driver thread.  Instead we just format the message
+// into an in-memory ring, and leave the file I/O to a background
+// thread.  The ring doubles as OpenZWave's "queue" of recent
+// messages, which are written out on a dump trigger, and by our
+// fatal signal handler.
+//
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+
+#include "ozw_tools.h"
+
+using namespace OpenZWave;
+
+#define LOG_RING_SIZE		1024
+#define LOG_RECORD_LEN		240
+#define LOG_FILE_NAME		OZW_CACHE_DIR "/OZW_Log.txt"
+#define LOG_CRASH_SUFFIX	".crash"
+
+struct log_record {
+	struct timeval tv;
+	uint8_t level;
+	uint8_t nid;
+	char text[LOG_RECORD_LEN];
+};
+
+// The ring lives outside the i_LogImpl object, since OpenZWave
+// deletes that when the Manager is destroyed, and we'd still like to
+// be able to dump the ring if we crash after that.
+static struct log_record ring[LOG_RING_SIZE];
+static uint64_t ring_head;	// next record to fill
+static uint64_t ring_saved;	// next record for the writer to look at
+static uint64_t ring_dump;	// dump queued records up to here
+static uint64_t ring_dumped;	// queued records before here are written
+static uint64_t ring_dropped;
+static bool reopen;
+static pthread_mutex_t ring_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ring_cond = PTHREAD_COND_INITIALIZER;
+
+static LogLevel save_level = LogLevel_Detail;
+static LogLevel queue_level = LogLevel_Debug;
+static LogLevel dump_trigger = LogLevel_Warning;
+static string log_file = LOG_FILE_NAME;
+static string crash_file = LOG_FILE_NAME LOG_CRASH_SUFFIX;
+
+static const char *level_names[] = {
+	"Invalid", "None", "Always", "Fatal", "Error", "Warning",
+	"Alert", "Info", "Detail", "Debug", "StreamDetail", "Internal",
+};
+
+#define NUM_LEVELS	(sizeof(level_names) / sizeof(level_names[0]))
+
+static const char *level_name(int level)
+{
+	if ((level < 0) || ((unsigned)level >= NUM_LEVELS))
+		return "Unknown";
+	return level_names[level];
+}
+
+bool ozw_parse_log_level(const char *s, int *levelp)
+{
+	unsigned long val;
+	char *ep;
+	unsigned i;
+
+	for (i = 0; i < NUM_LEVELS; i++)
+		if (strcasecmp(s, level_names[i]) == 0) {
+			*levelp = i;
+			return true;
+		}
+
+	val = strtoul(s, &ep, 0);
+	if (*ep || (val >= NUM_LEVELS))
+		return false;
+
+	*levelp = val;
+	return true;
+}
+
+static int format_record(const struct log_record *r, char *buf, size_t len)
+{
+	struct tm tm;
+
+	localtime_r(&r->tv.tv_sec, &tm);
+	return snprintf(buf, len,
+			"%04d-%02d-%02d %02d:%02d:%02d.%03ld %s, Node%03d, %s\n",
+			tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+			tm.tm_hour, tm.tm_min, tm.tm_sec,
+			(long)r->tv.tv_usec / 1000, level_name(r->level),
+			r->nid, r->text);
+}
+
+class RingLog : public i_LogImpl {
+private:
+	pthread_t writer;
+	bool stopping;
+	FILE *f;
+	long max_size;
+
+	static void *writer_thread(void *arg);
+	void open_file(bool rotate);
+	void drain(void);
+
+public:
+	RingLog(long max_size, LogLevel save, LogLevel queue, LogLevel dump);
+	virtual ~RingLog();
+
+	virtual void Write(LogLevel level, uint8 const nid,
+			   char const *fmt, va_list args);
+	virtual void QueueDump();
+	virtual void QueueClear();
+	virtual void SetLoggingState(LogLevel save, LogLevel queue,
+				     LogLevel dump);
+	virtual void SetLogFileName(const string &filename);
+};
+
+// OpenZWave only passes its log level options to the logger it
+// creates itself, never to one set up ahead of it, so we take them
+// here
+RingLog::RingLog(long max_size, LogLevel save, LogLevel queue,
+		 LogLevel dump)
+	: stopping(false), f(NULL), max_size(max_size)
+{
+	save_level = save;
+	queue_level = queue;
+	dump_trigger = dump;
+	open_file(false);
+	pthread_create(&writer, NULL, writer_thread, this);
+}
+
+RingLog::~RingLog()
+{
+	pthread_mutex_lock(&ring_mutex);
+	stopping = true;
+	pthread_cond_signal(&ring_cond);
+	pthread_mutex_unlock(&ring_mutex);
+
+	pthread_join(writer, NULL);
+
+	if (f)
+		fclose(f);
+}
+
+void RingLog::open_file(bool rotate)
+{
+	if (f)
+		fclose(f);
+
+	if (rotate)
+		rename(log_file.c_str(), (log_file + ".1").c_str());
+
+	f = fopen(log_file.c_str(), "a");
+}
+
+//-----------------------------------------------------------------------------
+// <RingLog::Write>
+// Called from OpenZWave's threads, so this needs to stay cheap
+//-----------------------------------------------------------------------------
+void RingLog::Write(LogLevel level, uint8 const nid,
+		    char const *fmt, va_list args)
+{
+	struct log_record *r;
+	struct timeval tv;
+	char text[LOG_RECORD_LEN];
+
+	if ((level > save_level) && (level > queue_level))
+		return;
+
+	gettimeofday(&tv, NULL);
+	vsnprintf(text, sizeof(text), fmt, args);
+
+	pthread_mutex_lock(&ring_mutex);
+
+	r = &ring[ring_head % LOG_RING_SIZE];
+	if ((ring_head - ring_saved) >= LOG_RING_SIZE) {
+		// The writer has fallen behind; we never block on it
+		if (r->level <= save_level)
+			ring_dropped++;
+		ring_saved++;
+	}
+	r->tv = tv;
+	r->level = level;
+	r->nid = nid;
+	memcpy(r->text, text, sizeof(text));
+	ring_head++;
+
+	if (level <= dump_trigger)
+		ring_dump = ring_head;
+
+	if ((level <= save_level) || (ring_dump == ring_head))
+		pthread_cond_signal(&ring_cond);
+
+	pthread_mutex_unlock(&ring_mutex);
+}
+
+void RingLog::QueueDump()
+{
+	pthread_mutex_lock(&ring_mutex);
+	ring_dump = ring_head;
+	pthread_cond_signal(&ring_cond);
+	pthread_mutex_unlock(&ring_mutex);
+}
+
+void RingLog::QueueClear()
+{
+	// Nothing to do: queued records that aren't due to be saved are
+	// just overwritten in the ring in due course
+}
+
+void RingLog::SetLoggingState(LogLevel save, LogLevel queue, LogLevel dump)
+{
+	pthread_mutex_lock(&ring_mutex);
+	save_level = save;
+	queue_level = queue;
+	dump_trigger = dump;
+	pthread_mutex_unlock(&ring_mutex);
+}
+
+void RingLog::SetLogFileName(const string &filename)
+{
+	pthread_mutex_lock(&ring_mutex);
+	log_file = filename;
+	crash_file = filename + LOG_CRASH_SUFFIX;
+	reopen = true;
+	pthread_cond_signal(&ring_cond);
+	pthread_mutex_unlock(&ring_mutex);
+}
+
+// Anything for the writer to do?  Called with ring_mutex held.
+static bool ring_pending(void)
+{
+	return (ring_saved < ring_head) || (ring_dumped < ring_dump) || reopen;
+}
+
+//-----------------------------------------------------------------------------
+// <RingLog::drain>
+// Write out everything that's due, with the ring lock held only
+// while copying records out of the ring.  Records that are only
+// queued stay in the ring after the writer's passed them, so a dump
+// can go back for as many of them as the ring still holds.
+//-----------------------------------------------------------------------------
+void RingLog::drain(void)
+{
+	static struct log_record batch[LOG_RING_SIZE];
+	char buf[LOG_RECORD_LEN + 64];
+	uint64_t dropped, i, start, dump_start;
+	bool do_reopen;
+	int n = 0;
+
+	dump_start = ring_dumped;
+	if (ring_head - dump_start > LOG_RING_SIZE)
+		dump_start = ring_head - LOG_RING_SIZE;
+	start = ring_saved;
+	if ((ring_dump > dump_start) && (dump_start < start))
+		start = dump_start;
+
+	for (i = start; i < ring_head; i++) {
+		struct log_record *r = &ring[i % LOG_RING_SIZE];
+
+		if (r->level <= save_level) {
+			// Saved in its own right, unless it already was
+			if (i >= ring_saved)
+				batch[n++] = *r;
+		} else if ((i >= dump_start) && (i < ring_dump)
+			   && (r->level <= queue_level)) {
+			batch[n++] = *r;
+		}
+	}
+	ring_saved = ring_head;
+	if (ring_dump > ring_dumped)
+		ring_dumped = ring_dump;
+	dropped = ring_dropped;
+	ring_dropped = 0;
+	do_reopen = reopen;
+	reopen = false;
+
+	pthread_mutex_unlock(&ring_mutex);
+
+	if (do_reopen)
+		open_file(false);
+
+	if (f) {
+		if (dropped)
+			fprintf(f, "[%llu log records dropped]\n",
+				(unsigned long long)dropped);
+
+		for (int i = 0; i < n; i++) {
+			format_record(&batch[i], buf, sizeof(buf));
+			fputs(buf, f);
+		}
+		fflush(f);
+
+		if (max_size && (ftell(f) > max_size))
+			open_file(true);
+	}
+
+	pthread_mutex_lock(&ring_mutex);
+}
+
+void *RingLog::writer_thread(void *arg)
+{
+	RingLog *log = (RingLog *)arg;
+
+	pthread_mutex_lock(&ring_mutex);
+	while (!log->stopping) {
+		// A signal sent while drain() had the lock dropped is
+		// still seen here
+		while (!ring_pending() && !log->stopping)
+			pthread_cond_wait(&ring_cond, &ring_mutex);
+		log->drain();
+	}
+	log->drain();
+	pthread_mutex_unlock(&ring_mutex);
+
+	return NULL;
+}
+
+//-----------------------------------------------------------------------------
+// <crash_handler>
+// Dump whatever's in the ring on a fatal signal, then die as we
+// would have anyway.  This is best effort: it doesn't take the lock,
+// and snprintf() isn't strictly async-signal-safe.
+//-----------------------------------------------------------------------------
+static void crash_handler(int sig)
+{
+	char buf[LOG_RECORD_LEN + 64];
+	uint64_t i, start;
+	int fd;
+
+	fd = open(crash_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd >= 0) {
+		start = (ring_head > LOG_RING_SIZE)
+			? ring_head - LOG_RING_SIZE : 0;
+
+		for (i = start; i < ring_head; i++) {
+			int len = format_record(&ring[i % LOG_RING_SIZE],
+						buf, sizeof(buf));
+			if (len > (int)sizeof(buf) - 1)
+				len = sizeof(buf) - 1;
+			if (write(fd, buf, len) < 0)
+				break;
+		}
+		close(fd);
+	}
+
+	signal(sig, SIG_DFL);
+	raise(sig);
+}
+
+//
+// Install the logger.  This needs to be done before Manager::Create(),
+// which is when OpenZWave would otherwise set up its own.
+//
+void ozw_log_init(long max_size, int save, int queue, int dump)
+{
+	static const int fatal_signals[] = {
+		SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT,
+	};
+	unsigned i;
+
+	Log::SetLoggingClass(new RingLog(max_size, (LogLevel)save,
+					 (LogLevel)queue, (LogLevel)dump));
+
+	for (i = 0; i < sizeof(fatal_signals) / sizeof(fatal_signals[0]); i++)
+		signal(fatal_signals[i], crash_handler);
+}
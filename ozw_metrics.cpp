@@ -0,0 +1,187 @@
+//
+// ozw_metrics - Metrics derived from a value's samples
+//
+// Copyright David Gibson 2015 <ozw@gibson.dropbear.id.au>
+//
+// This program is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see
+// <http://www.gnu.org/licenses/>.
+//
+// Everything here is updated a sample at a time, so it costs the
+// same however long a tool runs.  Samples needn't be evenly spaced.
+//
+
+#include <stdlib.h>
+#include <math.h>
+
+#include "ozw_tools.h"
+
+#define DEFAULT_EWMA_TAU	60
+
+using namespace OpenZWave;
+
+static const struct {
+	const char *name;
+	unsigned bit;
+} metric_names[] = {
+	{ "raw", METRIC_RAW },
+	{ "rate", METRIC_RATE },
+	{ "counter", METRIC_COUNTER },
+	{ "integral", METRIC_INTEGRAL },
+	{ "ewma", METRIC_EWMA },
+};
+
+#define NUM_METRICS	(sizeof(metric_names) / sizeof(metric_names[0]))
+
+//-----------------------------------------------------------------------------
+// <parse_metrics>
+// Parse a '+' separated list of metric names, the EWMA optionally
+// with its time constant in seconds, e.g. "raw+counter+ewma=300"
+//-----------------------------------------------------------------------------
+bool parse_metrics(const string s, MetricSpec *spec)
+{
+	size_t pos = 0, end;
+
+	spec->mask = 0;
+	spec->ewma_tau = DEFAULT_EWMA_TAU;
+
+	while (pos <= s.size()) {
+		string name;
+		size_t eq;
+		unsigned i;
+
+		end = s.find('+', pos);
+		if (end == string::npos)
+			end = s.size();
+		name = s.substr(pos, end - pos);
+		pos = end + 1;
+
+		eq = name.find('=');
+		if (eq != string::npos) {
+			const char *p = name.c_str() + eq + 1;
+			char *ep;
+
+			if (name.substr(0, eq) != "ewma")
+				return false;
+			spec->ewma_tau = strtod(p, &ep);
+			if (!*p || *ep || !(spec->ewma_tau > 0))
+				return false;
+			name = "ewma";
+		}
+
+		for (i = 0; i < NUM_METRICS; i++)
+			if (name == metric_names[i].name)
+				break;
+		if (i == NUM_METRICS)
+			return false;
+		spec->mask |= metric_names[i].bit;
+	}
+
+	return true;
+}
+
+// Names of the metrics in spec, in the order they're output
+vector<string> metric_list(MetricSpec const &spec)
+{
+	vector<string> names;
+	unsigned i;
+
+	for (i = 0; i < NUM_METRICS; i++)
+		if (spec.mask & metric_names[i].bit)
+			names.push_back(metric_names[i].name);
+
+	return names;
+}
+
+//-----------------------------------------------------------------------------
+// <ozw_value_as_double>
+// Read any numeric value, or a bool as 0 or 1
+//-----------------------------------------------------------------------------
+bool ozw_value_as_double(Manager *mgr, ValueID const &vid, double *d)
+{
+	float f;
+	int32 i;
+	int16 s;
+	uint8 b;
+	bool flag;
+
+	switch (vid.GetType()) {
+	case ValueID::ValueType_Decimal:
+		if (!mgr->GetValueAsFloat(vid, &f))
+			return false;
+		*d = f;
+		return true;
+	case ValueID::ValueType_Int:
+		if (!mgr->GetValueAsInt(vid, &i))
+			return false;
+		*d = i;
+		return true;
+	case ValueID::ValueType_Short:
+		if (!mgr->GetValueAsShort(vid, &s))
+			return false;
+		*d = s;
+		return true;
+	case ValueID::ValueType_Byte:
+		if (!mgr->GetValueAsByte(vid, &b))
+			return false;
+		*d = b;
+		return true;
+	case ValueID::ValueType_Bool:
+		if (!mgr->GetValueAsBool(vid, &flag))
+			return false;
+		*d = flag;
+		return true;
+	default:
+		return false;
+	}
+}
+
+DerivedMetrics::DerivedMetrics()
+	: samples(0), rate(0), counter_rate(0), resets(0), integral(0),
+	  ewma(0), last(0), last_ns(0)
+{
+}
+
+//-----------------------------------------------------------------------------
+// <DerivedMetrics::sample>
+// Take in a new sample, taken at time ns.  For a counter, a drop is
+// taken to mean the counter's been reset, or rolled over, and started
+// again from zero, so the increase is the whole of the new value.
+// The integral uses the trapezoid rule.  The EWMA weights each
+// sample by the time since the last, so irregular polls don't skew
+// it.
+//-----------------------------------------------------------------------------
+void DerivedMetrics::sample(double v, uint64_t ns, double ewma_tau)
+{
+	double dt = (ns - last_ns) / 1e9;
+	double increase;
+
+	if (!samples++) {
+		ewma = v;
+	} else if (dt > 0) {
+		rate = (v - last) / dt;
+
+		increase = v - last;
+		if (increase < 0) {
+			increase = v;
+			resets++;
+		}
+		counter_rate = increase / dt;
+
+		integral += (last + v) / 2 * dt;
+		ewma += (v - ewma) * (1 - exp(-dt / ewma_tau));
+	}
+
+	last = v;
+	last_ns = ns;
+}
@@ -0,0 +1,257 @@
+//
+// ozw_nodes - Node sleep tracking and wake-up scheduling
+//
+// Copyright David Gibson 2015 <ozw@gibson.dropbear.id.au>
+//
+// This program is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see
+// <http://www.gnu.org/licenses/>.
+//
+// Requests to a sleeping battery device just sit in OpenZWave's send
+// queue until the device wakes, holding up traffic to everything
+// else.  So we keep track of which nodes sleep and whether they're
+// awake, and hold requests for sleeping nodes here instead, sending
+// them all together as soon as the node wakes up.
+//
+#include <pthread.h>
+#include <set>
+
+#include "ozw_tools.h"
+
+using namespace OpenZWave;
+
+struct NodeState {
+	bool known;
+	bool listening;
+	bool awake;
+	set<ValueID> pending;		// refresh once, on next wake
+	set<ValueID> on_wake;		// refresh on every wake
+};
+
+static NodeState nodes[OZW_MAX_DRIVERS][256];
+static pthread_mutex_t nodes_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// The notifications we act on, everything else skips the lock
+static const uint32_t nodes_types =
+	(1U << Notification::Type_NodeProtocolInfo)
+	| (1U << Notification::Type_EssentialNodeQueriesComplete)
+	| (1U << Notification::Type_NodeQueriesComplete)
+	| (1U << Notification::Type_Notification)
+	| (1U << Notification::Type_NodeEvent)
+	| (1U << Notification::Type_NodeRemoved);
+
+static NodeState *node_state(uint32_t hid, uint8_t nid)
+{
+	int shard = ozw_shard(hid);
+
+	if (shard < 0)
+		return NULL;
+
+	return &nodes[shard][nid];
+}
+
+bool ozw_node_sleeps(uint32_t hid, uint8_t nid)
+{
+	NodeState *ns;
+	bool ret = false;
+
+	pthread_mutex_lock(&nodes_mutex);
+	ns = node_state(hid, nid);
+	if (ns && ns->known)
+		ret = !ns->listening;
+	pthread_mutex_unlock(&nodes_mutex);
+
+	return ret;
+}
+
+bool ozw_node_awake(uint32_t hid, uint8_t nid)
+{
+	NodeState *ns;
+	bool ret = true;
+
+	pthread_mutex_lock(&nodes_mutex);
+	ns = node_state(hid, nid);
+	if (ns && ns->known)
+		ret = ns->awake;
+	pthread_mutex_unlock(&nodes_mutex);
+
+	return ret;
+}
+
+//-----------------------------------------------------------------------------
+// <ozw_refresh_value>
+// Request a fresh reading of a value, now if the node is awake,
+// otherwise as soon as it next wakes up
+//-----------------------------------------------------------------------------
+void ozw_refresh_value(Manager *mgr, ValueID const &vid)
+{
+	NodeState *ns;
+
+	pthread_mutex_lock(&nodes_mutex);
+	ns = node_state(vid.GetHomeId(), vid.GetNodeId());
+	if (ns && ns->known && !ns->awake) {
+		ns->pending.insert(vid);
+		pthread_mutex_unlock(&nodes_mutex);
+		return;
+	}
+	pthread_mutex_unlock(&nodes_mutex);
+
+	ozw_budget_interactive(vid);
+	mgr->RefreshValue(vid);
+}
+
+//-----------------------------------------------------------------------------
+// <ozw_poll_on_wake>
+// Refresh a value of a sleeping node every time it wakes up, in
+// place of polling it
+//-----------------------------------------------------------------------------
+void ozw_poll_on_wake(ValueID const &vid, bool enable)
+{
+	NodeState *ns;
+
+	pthread_mutex_lock(&nodes_mutex);
+	ns = node_state(vid.GetHomeId(), vid.GetNodeId());
+	if (ns) {
+		if (enable)
+			ns->on_wake.insert(vid);
+		else
+			ns->on_wake.erase(vid);
+	}
+	pthread_mutex_unlock(&nodes_mutex);
+}
+
+//-----------------------------------------------------------------------------
+// <node_woke>
+// Send everything we've been holding in one go, while the node's
+// listening.  Held refreshes go out as the interactive requests they
+// were, and wake-up polls take their turn in the poll budget like
+// any other poll.
+//-----------------------------------------------------------------------------
+static void node_woke(Manager *mgr, NodeState *ns)
+{
+	list<ValueID> batch, polls;
+
+	ns->awake = true;
+
+	batch.insert(batch.end(), ns->pending.begin(), ns->pending.end());
+	for (set<ValueID>::iterator it = ns->on_wake.begin();
+	     it != ns->on_wake.end(); it++)
+		if (!ns->pending.count(*it))
+			polls.push_back(*it);
+	ns->pending.clear();
+
+	pthread_mutex_unlock(&nodes_mutex);
+
+	for (list<ValueID>::iterator it = batch.begin();
+	     it != batch.end(); it++) {
+		ozw_budget_interactive(*it);
+		mgr->RefreshValue(*it);
+	}
+
+	for (list<ValueID>::iterator it = polls.begin();
+	     it != polls.end(); it++) {
+		if (ozw_budget_enabled())
+			ozw_budget_poll(*it);
+		else
+			mgr->RefreshValue(*it);
+	}
+
+	pthread_mutex_lock(&nodes_mutex);
+}
+
+//-----------------------------------------------------------------------------
+// <ozw_node_cached>
+// Learn whether a node sleeps from the cached network config, on a
+// warm start.  A sleeping node is taken to be asleep until we hear
+// from it.
+//-----------------------------------------------------------------------------
+void ozw_node_cached(uint32_t hid, uint8_t nid, bool listening)
+{
+	NodeState *ns;
+
+	pthread_mutex_lock(&nodes_mutex);
+	ns = node_state(hid, nid);
+	if (ns && !ns->known) {
+		ns->listening = listening;
+		ns->awake = listening;
+		ns->known = true;
+	}
+	pthread_mutex_unlock(&nodes_mutex);
+}
+
+//-----------------------------------------------------------------------------
+// <ozw_nodes_notification>
+// Update node state from a notification, called by the shared
+// watcher before the tool's own handler
+//-----------------------------------------------------------------------------
+void ozw_nodes_notification(Notification const *n)
+{
+	Manager *mgr = Manager::Get();
+	uint32_t hid = n->GetHomeId();
+	uint8_t nid = n->GetNodeId();
+	int type = n->GetType();
+	NodeState *ns;
+
+	if ((type < 0) || (type >= OZW_NOTIFICATION_TYPES)
+	    || !(nodes_types & (1U << type)))
+		return;
+	if ((type == Notification::Type_Notification)
+	    && (n->GetNotification() != Notification::Code_Awake)
+	    && (n->GetNotification() != Notification::Code_Sleep))
+		return;
+
+	pthread_mutex_lock(&nodes_mutex);
+
+	ns = node_state(hid, nid);
+	if (!ns) {
+		pthread_mutex_unlock(&nodes_mutex);
+		return;
+	}
+
+	switch (n->GetType()) {
+	case Notification::Type_NodeProtocolInfo:
+	case Notification::Type_EssentialNodeQueriesComplete:
+	case Notification::Type_NodeQueriesComplete:
+		ns->listening = mgr->IsNodeListeningDevice(hid, nid)
+			|| mgr->IsNodeFrequentListeningDevice(hid, nid);
+		if (!ns->known)
+			ns->awake = ns->listening || mgr->IsNodeAwake(hid, nid);
+		ns->known = true;
+		break;
+
+	case Notification::Type_Notification:
+		if (n->GetNotification() == Notification::Code_Awake)
+			node_woke(mgr, ns);
+		else if (n->GetNotification() == Notification::Code_Sleep)
+			ns->awake = ns->listening;
+		break;
+
+	case Notification::Type_NodeEvent:
+		// A node that's just sent us something is awake, at
+		// least for now
+		if (ns->known && !ns->awake)
+			node_woke(mgr, ns);
+		break;
+
+	case Notification::Type_NodeRemoved:
+		ns->known = false;
+		ns->pending.clear();
+		ns->on_wake.clear();
+		break;
+
+	default:
+		break;
+	}
+
+	pthread_mutex_unlock(&nodes_mutex);
+}
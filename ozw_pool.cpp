@@ -0,0 +1,83 @@
+//
+// ozw_pool - Fixed size object pool
+//
+// Copyright David Gibson 2015 <ozw@gibson.dropbear.id.au>
+//
+// This program is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see
+// <http://www.gnu.org/licenses/>.
+//
+// Tools like pollozw run for weeks, with values coming and going as
+// nodes are re-included.  Keeping per-value state in a pool means a
+// value removed gives its slot to the next one added, so memory use
+// is set by the size of the network rather than how long we've been
+// running.
+//
+#include <stdlib.h>
+#include <stddef.h>
+
+#include "ozw_tools.h"
+
+Pool::Pool(size_t size, size_t per_chunk)
+	: per_chunk(per_chunk), nlive(0), nbytes(0), free_list(NULL)
+{
+	size_t align = alignof(max_align_t);
+
+	if (size < sizeof(FreeObj))
+		size = sizeof(FreeObj);
+	this->size = (size + align - 1) & ~(align - 1);
+}
+
+Pool::~Pool()
+{
+	for (vector<void *>::iterator it = chunks.begin();
+	     it != chunks.end(); it++)
+		::free(*it);
+}
+
+void *Pool::alloc(void)
+{
+	FreeObj *obj;
+
+	if (!free_list) {
+		char *chunk = (char *)malloc(size * per_chunk);
+		size_t i;
+
+		if (!chunk)
+			throw std::bad_alloc();
+
+		chunks.push_back(chunk);
+		nbytes += size * per_chunk;
+
+		for (i = 0; i < per_chunk; i++) {
+			obj = (FreeObj *)(chunk + i * size);
+			obj->next = free_list;
+			free_list = obj;
+		}
+	}
+
+	obj = free_list;
+	free_list = obj->next;
+	nlive++;
+
+	return obj;
+}
+
+void Pool::free(void *p)
+{
+	FreeObj *obj = (FreeObj *)p;
+
+	obj->next = free_list;
+	free_list = obj;
+	nlive--;
+}
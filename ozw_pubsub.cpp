@@ -0,0 +1,390 @@
+//
+// ozw_pubsub - Local publish/subscribe of value updates
+//
+// Copyright David Gibson 2015 <ozw@gibson.dropbear.id.au>
+//
+// This program is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see
+// <http://www.gnu.org/licenses/>.
+//
+// Lets any number of local consumers share one tool's view of the
+// network, rather than each running its own tool against the same
+// controller.  Subscribers connect to a Unix socket and send a line
+// for each value they want.  The value is written in the usual
+// "<home-id>:<node-id> <instance>,<command class>,<index>" form.
+// They then get every line published about those values.
+//
+// Publishing only queues the line, so it never waits on a
+// subscriber.  A single epoll thread does all the socket I/O.  Each
+// subscriber's queue is bounded, and when it's full the oldest line
+// goes.  The subscriber is told how many were dropped.
+//
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <deque>
+
+#include "ozw_tools.h"
+
+// Lines queued for one subscriber before we start dropping them
+#define PUBSUB_QUEUE_MAX	256
+
+// Longest request line we'll accept
+#define PUBSUB_LINE_MAX		256
+
+// Subscriptions one subscriber can hold, each checked on every publish
+#define PUBSUB_MATCHERS_MAX	64
+
+using namespace OpenZWave;
+
+struct Subscriber {
+	int fd;
+	string in;			// partial request line
+	list<ValueMatcher *> matchers;
+	deque<string> queue;
+	size_t offset;			// how much of queue.front() is sent
+	unsigned long dropped;
+	bool want_out;			// waiting for EPOLLOUT
+};
+
+static pthread_mutex_t pubsub_mutex = PTHREAD_MUTEX_INITIALIZER;
+static map<int, Subscriber *> subscribers;
+static string sock_path;
+static int listen_fd = -1;
+static int epoll_fd = -1;
+static int wake_fd = -1;
+
+static void close_subscriber(Subscriber *s)
+{
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, s->fd, NULL);
+	close(s->fd);
+	subscribers.erase(s->fd);
+
+	for (list<ValueMatcher *>::iterator it = s->matchers.begin();
+	     it != s->matchers.end(); it++)
+		delete *it;
+	delete s;
+}
+
+// Called with pubsub_mutex held
+static void queue_line(Subscriber *s, const string &line)
+{
+	if (s->queue.size() >= PUBSUB_QUEUE_MAX) {
+		// The front line may be partly sent, so keep that one
+		if (s->offset)
+			s->queue.erase(s->queue.begin() + 1);
+		else
+			s->queue.pop_front();
+		s->dropped++;
+	}
+
+	s->queue.push_back(line);
+}
+
+//-----------------------------------------------------------------------------
+// <flush>
+// Send as much of a subscriber's queue as the socket will take.
+// Returns false if the subscriber's gone away.  Called with
+// pubsub_mutex held.
+//-----------------------------------------------------------------------------
+static bool flush(Subscriber *s)
+{
+	struct epoll_event ev;
+	bool want_out;
+
+	if (s->dropped && !s->offset) {
+		s->queue.push_front(stringf("# dropped %lu\n", s->dropped));
+		s->dropped = 0;
+	}
+
+	while (!s->queue.empty()) {
+		string &line = s->queue.front();
+		ssize_t n;
+
+		n = send(s->fd, line.data() + s->offset,
+			 line.size() - s->offset, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (n < 0) {
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+				break;
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+
+		s->offset += n;
+		if (s->offset == line.size()) {
+			s->queue.pop_front();
+			s->offset = 0;
+		}
+	}
+
+	want_out = !s->queue.empty();
+	if (want_out != s->want_out) {
+		ev.events = want_out ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+		ev.data.fd = s->fd;
+		epoll_ctl(epoll_fd, EPOLL_CTL_MOD, s->fd, &ev);
+		s->want_out = want_out;
+	}
+
+	return true;
+}
+
+// Called with pubsub_mutex held.  Returns false if the subscriber
+// should be dropped.
+static bool parse_requests(Subscriber *s)
+{
+	size_t nl;
+
+	while ((nl = s->in.find('\n')) != string::npos) {
+		char nstr[32], vstr[32];
+		string line = s->in.substr(0, nl);
+		ValueMatcher *m;
+
+		s->in.erase(0, nl + 1);
+
+		if (line.size() > PUBSUB_LINE_MAX)
+			return false;
+
+		if (sscanf(line.c_str(), "%31s %31s", nstr, vstr) != 2) {
+			queue_line(s, "# bad subscription: " + line + "\n");
+			continue;
+		}
+
+		if (s->matchers.size() >= PUBSUB_MATCHERS_MAX) {
+			queue_line(s, "# too many subscriptions: " + line + "\n");
+			continue;
+		}
+
+		m = new ValueMatcher(nstr, vstr);
+		if (!m->valid()) {
+			delete m;
+			queue_line(s, "# bad subscription: " + line + "\n");
+			continue;
+		}
+		s->matchers.push_back(m);
+	}
+
+	return s->in.size() <= PUBSUB_LINE_MAX;
+}
+
+//-----------------------------------------------------------------------------
+// <read_requests>
+// Take in subscription lines.  Returns false if the subscriber's gone
+// away, or sent a line longer than PUBSUB_LINE_MAX.  Called with
+// pubsub_mutex held.
+//-----------------------------------------------------------------------------
+static bool read_requests(Subscriber *s)
+{
+	char buf[512];
+	ssize_t n;
+
+	for (;;) {
+		n = recv(s->fd, buf, sizeof(buf), MSG_DONTWAIT);
+		if (n == 0)
+			return false;
+		if (n < 0) {
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+				break;
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		s->in.append(buf, n);
+
+		// A chunk at a time, so a client can't make us buffer
+		// more than a line
+		if (!parse_requests(s))
+			return false;
+	}
+
+	return flush(s);
+}
+
+// Called with pubsub_mutex held
+static void accept_subscribers(void)
+{
+	struct epoll_event ev;
+	Subscriber *s;
+	int fd;
+
+	while ((fd = accept4(listen_fd, NULL, NULL,
+			     SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+		s = new Subscriber();
+		s->fd = fd;
+
+		ev.events = EPOLLIN;
+		ev.data.fd = fd;
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+			close(fd);
+			delete s;
+			continue;
+		}
+
+		subscribers[fd] = s;
+	}
+}
+
+static void *pubsub_thread(void *arg)
+{
+	struct epoll_event events[16];
+	uint64_t val;
+	int i, n;
+
+	for (;;) {
+		n = epoll_wait(epoll_fd, events, 16, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		pthread_mutex_lock(&pubsub_mutex);
+		for (i = 0; i < n; i++) {
+			int fd = events[i].data.fd;
+			map<int, Subscriber *>::iterator it;
+
+			if (fd == listen_fd) {
+				accept_subscribers();
+				continue;
+			}
+
+			if (fd == wake_fd) {
+				// Something's been published
+				if (read(wake_fd, &val, sizeof(val)) < 0)
+					continue;
+
+				it = subscribers.begin();
+				while (it != subscribers.end()) {
+					Subscriber *s = (it++)->second;
+
+					if (!s->queue.empty() && !flush(s))
+						close_subscriber(s);
+				}
+				continue;
+			}
+
+			// Closed by an earlier event in this batch?
+			it = subscribers.find(fd);
+			if (it == subscribers.end())
+				continue;
+
+			if ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+			    && !read_requests(it->second))
+				close_subscriber(it->second);
+			else if ((events[i].events & EPOLLOUT)
+				 && !flush(it->second))
+				close_subscriber(it->second);
+		}
+		pthread_mutex_unlock(&pubsub_mutex);
+	}
+
+	return NULL;
+}
+
+//-----------------------------------------------------------------------------
+// <ozw_pubsub_start>
+// Listen for subscribers on a Unix socket at path, replacing any old
+// socket there.  Returns false, with errno set, if we can't.
+//-----------------------------------------------------------------------------
+bool ozw_pubsub_start(const char *path)
+{
+	struct sockaddr_un addr;
+	struct epoll_event ev;
+	pthread_t thread;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return false;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			   0);
+	if (listen_fd < 0)
+		return false;
+
+	unlink(path);
+	if ((bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+	    || (listen(listen_fd, 16) < 0))
+		return false;
+	sock_path = path;
+
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if ((epoll_fd < 0) || (wake_fd < 0))
+		return false;
+
+	ev.events = EPOLLIN;
+	ev.data.fd = listen_fd;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+	ev.data.fd = wake_fd;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev);
+
+	errno = pthread_create(&thread, NULL, pubsub_thread, NULL);
+	if (errno)
+		return false;
+	pthread_detach(thread);
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// <ozw_pubsub_publish>
+// Queue a line for everyone subscribed to the value.  Never blocks on
+// a subscriber.
+//-----------------------------------------------------------------------------
+void ozw_pubsub_publish(ValueID const &vid, const string &line)
+{
+	uint64_t one = 1;
+	bool queued = false;
+
+	if (listen_fd < 0)
+		return;
+
+	pthread_mutex_lock(&pubsub_mutex);
+	for (map<int, Subscriber *>::iterator it = subscribers.begin();
+	     it != subscribers.end(); it++) {
+		Subscriber *s = it->second;
+
+		for (list<ValueMatcher *>::iterator m = s->matchers.begin();
+		     m != s->matchers.end(); m++) {
+			if ((*m)->matches(vid)) {
+				queue_line(s, line);
+				queued = true;
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock(&pubsub_mutex);
+
+	// If this fails, the counter's full so a wake up is due anyway
+	if (queued && (write(wake_fd, &one, sizeof(one)) < 0))
+		return;
+}
+
+void ozw_pubsub_stop(void)
+{
+	if (listen_fd < 0)
+		return;
+
+	unlink(sock_path.c_str());
+}
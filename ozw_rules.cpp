@@ -0,0 +1,523 @@
+//
+// ozw_rules - Threshold rules evaluated as values arrive
+//
+// Copyright David Gibson 2015 <ozw@gibson.dropbear.id.au>
+//
+// This program is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see
+// <http://www.gnu.org/licenses/>.
+//
+// A rule file has one rule per line:
+//
+//   <name> <home-id>:<node-id> <instance>,<command class>,<index>
+//       above|below <threshold> [for <seconds>] [clear <level>]
+//       [every <seconds>] <action>...
+//
+// where each action is either "event", to write a line to the event
+// sink, or "set <home-id>:<node-id> <instance>,<command class>,<index>
+// <value>".  A rule fires once its value has been past the threshold
+// for the given time.  It then stays quiet until the value comes back
+// past the clear level, which defaults to the threshold.  With
+// "every", it fires at most once in that many seconds.
+//
+// Rules are parsed once, and each is tied to its value as the value
+// is added, so a sample only costs a map lookup and a few
+// comparisons.  Values to set are written after the rules lock is
+// dropped.
+//
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <algorithm>
+
+#include "ozw_tools.h"
+
+using namespace OpenZWave;
+
+struct RuleAction {
+	ValueMatcher *matcher;
+	ValueID vid;
+	bool resolved;
+	string value;
+
+	RuleAction() : matcher(NULL), vid(0, (uint64)0), resolved(false) {}
+};
+
+struct Rule {
+	string name;
+	string source_text;
+	ValueMatcher *source;
+	bool above;
+	double threshold, clear;
+	uint64_t hold_ns, every_ns;
+	bool event;
+	vector<RuleAction> sets;
+
+	// State
+	uint64_t since_ns;	// when the value went past, 0 if it isn't
+	bool active;		// fired, and not yet cleared
+	uint64_t fired_ns;	// 0 if never
+};
+
+static pthread_mutex_t rules_mutex = PTHREAD_MUTEX_INITIALIZER;
+static vector<Rule *> rules;
+static map<ValueID, vector<Rule *> > by_value;
+static FILE *sink;
+static bool dry_run = false;
+
+static bool parse_double(const string &s, double *d)
+{
+	char *ep;
+
+	*d = strtod(s.c_str(), &ep);
+	return !s.empty() && !*ep;
+}
+
+static bool parse_seconds(const string &s, uint64_t *ns)
+{
+	double secs;
+
+	if (!parse_double(s, &secs) || (secs < 0))
+		return false;
+	*ns = secs * 1e9;
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// <parse_rule>
+// Parse one rule from its whitespace separated words
+//-----------------------------------------------------------------------------
+static Rule *parse_rule(vector<string> &w)
+{
+	Rule *r = new Rule();
+	bool have_clear = false;
+	size_t i;
+
+	if (w.size() < 6)
+		goto fail;
+
+	r->name = w[0];
+	r->source_text = w[1] + " " + w[2];
+	r->source = new ValueMatcher(w[1], w[2]);
+	if (!r->source->valid())
+		goto fail;
+
+	if (w[3] == "above")
+		r->above = true;
+	else if (w[3] != "below")
+		goto fail;
+	if (!parse_double(w[4], &r->threshold))
+		goto fail;
+
+	for (i = 5; i < w.size(); i++) {
+		bool more = (i + 1) < w.size();
+
+		if ((w[i] == "for") && more) {
+			if (!parse_seconds(w[++i], &r->hold_ns))
+				goto fail;
+		} else if ((w[i] == "clear") && more) {
+			if (!parse_double(w[++i], &r->clear))
+				goto fail;
+			have_clear = true;
+		} else if ((w[i] == "every") && more) {
+			if (!parse_seconds(w[++i], &r->every_ns))
+				goto fail;
+		} else if (w[i] == "event") {
+			r->event = true;
+		} else if ((w[i] == "set") && ((i + 3) < w.size())) {
+			RuleAction a;
+
+			a.matcher = new ValueMatcher(w[i + 1], w[i + 2]);
+			a.value = w[i + 3];
+			r->sets.push_back(a);
+			if (!a.matcher->valid())
+				goto fail;
+			i += 3;
+		} else {
+			goto fail;
+		}
+	}
+
+	if (!r->event && r->sets.empty())
+		goto fail;
+
+	// The clear level has to be on the near side of the threshold
+	if (!have_clear)
+		r->clear = r->threshold;
+	else if (r->above ? (r->clear > r->threshold)
+		 : (r->clear < r->threshold))
+		goto fail;
+
+	return r;
+
+fail:
+	delete r->source;
+	for (i = 0; i < r->sets.size(); i++)
+		delete r->sets[i].matcher;
+	delete r;
+	return NULL;
+}
+
+//-----------------------------------------------------------------------------
+// <ozw_rules_load>
+// Read the rules in file, sending events to sink.  Returns false,
+// having said why, if there's anything wrong with them.
+//-----------------------------------------------------------------------------
+bool ozw_rules_load(const char *file, FILE *f)
+{
+	string text;
+	size_t pos, nl;
+	int line = 0;
+
+	if (!read_file(file, &text)) {
+		fprintf(stderr, "Couldn't read %s: %s\n", file, strerror(errno));
+		return false;
+	}
+
+	for (pos = 0; pos < text.size(); pos = nl + 1) {
+		vector<string> words;
+		size_t start, end;
+		string l;
+		Rule *r;
+
+		line++;
+		nl = text.find('\n', pos);
+		if (nl == string::npos)
+			nl = text.size();
+		l = text.substr(pos, nl - pos);
+
+		for (start = l.find_first_not_of(" \t"); start != string::npos;
+		     start = l.find_first_not_of(" \t", end)) {
+			end = l.find_first_of(" \t", start);
+			words.push_back(l.substr(start, end - start));
+			if (end == string::npos)
+				break;
+		}
+
+		if (words.empty() || (words[0][0] == '#'))
+			continue;
+
+		r = parse_rule(words);
+		if (!r) {
+			fprintf(stderr, "%s:%d: bad rule\n", file, line);
+			return false;
+		}
+		rules.push_back(r);
+	}
+
+	sink = f;
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// <ozw_rules_value_added>
+// Tie a new value to the rules that watch it, or set it
+//-----------------------------------------------------------------------------
+void ozw_rules_value_added(ValueID const &vid)
+{
+	pthread_mutex_lock(&rules_mutex);
+
+	for (vector<Rule *>::iterator it = rules.begin();
+	     it != rules.end(); it++) {
+		Rule *r = *it;
+
+		if (r->source->matches(vid)) {
+			vector<Rule *> &v = by_value[vid];
+
+			if (find(v.begin(), v.end(), r) == v.end())
+				v.push_back(r);
+		}
+
+		for (vector<RuleAction>::iterator at = r->sets.begin();
+		     at != r->sets.end(); at++) {
+			if (at->matcher->matches(vid)) {
+				at->vid = vid;
+				at->resolved = true;
+			}
+		}
+	}
+
+	pthread_mutex_unlock(&rules_mutex);
+}
+
+void ozw_rules_value_removed(ValueID const &vid)
+{
+	pthread_mutex_lock(&rules_mutex);
+
+	by_value.erase(vid);
+	for (vector<Rule *>::iterator it = rules.begin();
+	     it != rules.end(); it++)
+		for (vector<RuleAction>::iterator at = (*it)->sets.begin();
+		     at != (*it)->sets.end(); at++)
+			if (at->resolved && (at->vid == vid))
+				at->resolved = false;
+
+	pthread_mutex_unlock(&rules_mutex);
+}
+
+// Called with rules_mutex held
+static void emit(Rule *r, const char *what, double v)
+{
+	struct timespec ts;
+
+	if (!r->event || dry_run)
+		return;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	fprintf(sink, "%ld.%03ld\t%s\t%s\t%s\t%g\n", (long)ts.tv_sec,
+		ts.tv_nsec / 1000000, r->name.c_str(), what,
+		r->source_text.c_str(), v);
+	fflush(sink);
+}
+
+//-----------------------------------------------------------------------------
+// <evaluate>
+// Run one rule on a new sample, returning true if it fires.  Called
+// with rules_mutex held.
+//-----------------------------------------------------------------------------
+static bool evaluate(Rule *r, double v, uint64_t now)
+{
+	bool past = r->above ? (v > r->threshold) : (v < r->threshold);
+
+	if (r->active) {
+		if (r->above ? (v > r->clear) : (v < r->clear))
+			return false;
+		r->active = false;
+		r->since_ns = 0;
+		emit(r, "clear", v);
+		return false;
+	}
+
+	if (!past) {
+		r->since_ns = 0;
+		return false;
+	}
+
+	if (!r->since_ns)
+		r->since_ns = now;
+	if ((now - r->since_ns) < r->hold_ns)
+		return false;
+	if (r->fired_ns && ((now - r->fired_ns) < r->every_ns))
+		return false;
+
+	r->active = true;
+	r->fired_ns = now;
+	emit(r, "fire", v);
+	return true;
+}
+
+// Called with rules_mutex held
+static void rules_sample(ValueID const &vid, double v, uint64_t now,
+			 list<RuleAction> *todo)
+{
+	map<ValueID, vector<Rule *> >::iterator it = by_value.find(vid);
+
+	if (it == by_value.end())
+		return;
+
+	for (vector<Rule *>::iterator rt = it->second.begin();
+	     rt != it->second.end(); rt++) {
+		if (!evaluate(*rt, v, now) || dry_run)
+			continue;
+		todo->insert(todo->end(), (*rt)->sets.begin(),
+			     (*rt)->sets.end());
+	}
+}
+
+//-----------------------------------------------------------------------------
+// <ozw_rules_sample>
+// Run every rule watching a value on its latest sample, and carry
+// out the actions of any that fire.  Writes go in the interactive
+// lane, ahead of polls.
+//-----------------------------------------------------------------------------
+void ozw_rules_sample(Manager *mgr, ValueID const &vid)
+{
+	list<RuleAction> todo;
+	double v;
+
+	if (rules.empty())
+		return;
+
+	pthread_mutex_lock(&rules_mutex);
+	if (!by_value.count(vid) || !ozw_value_as_double(mgr, vid, &v)) {
+		pthread_mutex_unlock(&rules_mutex);
+		return;
+	}
+	rules_sample(vid, v, ozw_now_ns(), &todo);
+	pthread_mutex_unlock(&rules_mutex);
+
+	for (list<RuleAction>::iterator it = todo.begin();
+	     it != todo.end(); it++) {
+		if (!it->resolved) {
+			fprintf(stderr, "No value to set for rule\n");
+			continue;
+		}
+		ozw_budget_interactive(it->vid);
+		if (!mgr->SetValue(it->vid, it->value))
+			fprintf(stderr, "Unable to set %s %s to %s\n",
+				format_znode(it->vid.GetHomeId(),
+					     it->vid.GetNodeId()).c_str(),
+				format_vid(it->vid).c_str(), it->value.c_str());
+	}
+}
+
+// A rule's state, to put back after a benchmark
+struct RuleState {
+	uint64_t since_ns;
+	bool active;
+	uint64_t fired_ns;
+};
+
+// Called with rules_mutex held
+static void save_state(vector<RuleState> *saved)
+{
+	for (vector<Rule *>::iterator it = rules.begin();
+	     it != rules.end(); it++) {
+		RuleState st = { (*it)->since_ns, (*it)->active,
+				 (*it)->fired_ns };
+
+		saved->push_back(st);
+	}
+}
+
+// Called with rules_mutex held
+static void restore_state(vector<RuleState> const &saved)
+{
+	for (size_t i = 0; i < rules.size(); i++) {
+		rules[i]->since_ns = saved[i].since_ns;
+		rules[i]->active = saved[i].active;
+		rules[i]->fired_ns = saved[i].fired_ns;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// <ozw_rules_benchmark>
+// Time the rules on made up samples a millisecond apart, swinging
+// each value across its threshold and back, so rules without a hold
+// time fire and clear.  Nothing's actually sent or written.  This
+// leaves out reading the value from OpenZWave, which
+// ozw_rules_benchmark_read() covers.  The made up values may well
+// be real ones, so call it before the network's up, and it leaves
+// the rules as it found them.  Returns nanoseconds per sample.
+//-----------------------------------------------------------------------------
+double ozw_rules_benchmark(unsigned long samples)
+{
+	vector<ValueID> vids;
+	list<RuleAction> todo;
+	vector<RuleState> saved;
+	vector<vector<RuleAction> > saved_sets;
+	map<ValueID, vector<Rule *> > saved_by_value;
+	uint64_t start, now;
+	unsigned long i;
+	bool was_dry_run;
+
+	if (rules.empty())
+		return 0;
+
+	pthread_mutex_lock(&rules_mutex);
+	was_dry_run = dry_run;
+	dry_run = true;
+	save_state(&saved);
+	for (vector<Rule *>::iterator it = rules.begin();
+	     it != rules.end(); it++)
+		saved_sets.push_back((*it)->sets);
+	saved_by_value = by_value;
+	pthread_mutex_unlock(&rules_mutex);
+
+	for (vector<Rule *>::iterator it = rules.begin();
+	     it != rules.end(); it++) {
+		uint32_t hid;
+		uint8_t nid, instance, ccid, index;
+		size_t space = (*it)->source_text.find(' ');
+
+		parse_znode((*it)->source_text.substr(0, space), &hid, &nid);
+		parse_vid((*it)->source_text.substr(space + 1),
+			  &instance, &ccid, &index);
+		vids.push_back(ValueID(hid, nid, ValueID::ValueGenre_User,
+				       ccid, instance, index,
+				       ValueID::ValueType_Decimal));
+		ozw_rules_value_added(vids.back());
+	}
+
+	now = ozw_now_ns();
+	start = now;
+	for (i = 0; i < samples; i++) {
+		Rule *r = rules[i % rules.size()];
+		double v = ((i / rules.size()) % 4 < 2)
+			? r->threshold + (r->above ? 1 : -1)
+			: r->clear + (r->above ? -1 : 1);
+
+		pthread_mutex_lock(&rules_mutex);
+		rules_sample(vids[i % vids.size()], v, now + i * 1000000,
+			     &todo);
+		pthread_mutex_unlock(&rules_mutex);
+	}
+	now = ozw_now_ns();
+
+	pthread_mutex_lock(&rules_mutex);
+	restore_state(saved);
+	for (i = 0; i < rules.size(); i++)
+		rules[i]->sets = saved_sets[i];
+	by_value = saved_by_value;
+	dry_run = was_dry_run;
+	pthread_mutex_unlock(&rules_mutex);
+
+	return (double)(now - start) / samples;
+}
+
+//-----------------------------------------------------------------------------
+// <ozw_rules_benchmark_read>
+// Time the whole of ozw_rules_sample(), reading each value from
+// OpenZWave as well as evaluating its rules, over the values rules
+// are tied to, so call it once they've been added.  Nothing's
+// actually sent or written, and the rules' state is put back after.
+// Returns nanoseconds per sample, or 0 if no rule has its value.
+//-----------------------------------------------------------------------------
+double ozw_rules_benchmark_read(Manager *mgr, unsigned long samples,
+				size_t *nvalues)
+{
+	vector<ValueID> vids;
+	vector<RuleState> saved;
+	uint64_t start, now;
+	unsigned long i;
+	bool was_dry_run;
+
+	pthread_mutex_lock(&rules_mutex);
+	was_dry_run = dry_run;
+	dry_run = true;
+	save_state(&saved);
+	for (map<ValueID, vector<Rule *> >::iterator it = by_value.begin();
+	     it != by_value.end(); it++)
+		vids.push_back(it->first);
+	pthread_mutex_unlock(&rules_mutex);
+
+	*nvalues = vids.size();
+
+	start = ozw_now_ns();
+	for (i = 0; (i < samples) && !vids.empty(); i++)
+		ozw_rules_sample(mgr, vids[i % vids.size()]);
+	now = ozw_now_ns();
+
+	pthread_mutex_lock(&rules_mutex);
+	restore_state(saved);
+	dry_run = was_dry_run;
+	pthread_mutex_unlock(&rules_mutex);
+
+	if (vids.empty())
+		return 0;
+
+	return (double)(now - start) / samples;
+}
@@ -0,0 +1,273 @@
+//
+// ozw_stats - Notification pipeline instrumentation
+//
+// Copyright David Gibson 2015 <ozw@gibson.dropbear.id.au>
+//
+// This program is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see
+// <http://www.gnu.org/licenses/>.
+//
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "ozw_tools.h"
+
+using namespace OpenZWave;
+
+// Counters are updated from the OpenZWave notification thread(s) and
+// read from whichever thread produces the report, so they're only
+// ever touched with atomic builtins.  Relaxed ordering is enough, we
+// just want the numbers to be roughly consistent.
+struct type_stats {
+	uint64_t count;
+	uint64_t handler_ns;
+	uint64_t handler_max_ns;
+	uint64_t lockwait_ns;
+	uint64_t lockwait_max_ns;
+};
+
+static struct type_stats stats[OZW_NOTIFICATION_TYPES];
+
+// Per-thread state for the notification currently being handled
+static __thread int cur_type = -1;
+static __thread uint64_t cur_lockwait;
+
+uint64_t ozw_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//-----------------------------------------------------------------------------
+// <ozw_rss_bytes>
+// Our resident set size, or 0 if we can't tell
+//-----------------------------------------------------------------------------
+size_t ozw_rss_bytes(void)
+{
+	FILE *f = fopen("/proc/self/statm", "r");
+	unsigned long size, resident;
+	int n;
+
+	if (!f)
+		return 0;
+
+	n = fscanf(f, "%lu %lu", &size, &resident);
+	fclose(f);
+	if (n != 2)
+		return 0;
+
+	return resident * sysconf(_SC_PAGESIZE);
+}
+
+static void stat_add(uint64_t *total, uint64_t *max, uint64_t val)
+{
+	uint64_t old;
+
+	__atomic_fetch_add(total, val, __ATOMIC_RELAXED);
+
+	old = __atomic_load_n(max, __ATOMIC_RELAXED);
+	while ((val > old)
+	       && !__atomic_compare_exchange_n(max, &old, val, true,
+					       __ATOMIC_RELAXED,
+					       __ATOMIC_RELAXED))
+		;
+}
+
+void ozw_stats_begin(Notification const *n)
+{
+	int type = n->GetType();
+
+	if ((type < 0) || (type >= OZW_NOTIFICATION_TYPES))
+		type = OZW_NOTIFICATION_TYPES - 1;
+
+	cur_type = type;
+	cur_lockwait = 0;
+}
+
+void ozw_stats_end(uint64_t start)
+{
+	struct type_stats *ts;
+
+	if (cur_type < 0)
+		return;
+
+	ts = &stats[cur_type];
+	__atomic_fetch_add(&ts->count, 1, __ATOMIC_RELAXED);
+	stat_add(&ts->handler_ns, &ts->handler_max_ns, ozw_now_ns() - start);
+	stat_add(&ts->lockwait_ns, &ts->lockwait_max_ns, cur_lockwait);
+
+	cur_type = -1;
+}
+
+void ozw_lock(pthread_mutex_t *mutex)
+{
+	uint64_t start;
+
+	// Don't bother timing the uncontended case
+	if (pthread_mutex_trylock(mutex) == 0)
+		return;
+
+	start = ozw_now_ns();
+	pthread_mutex_lock(mutex);
+	if (cur_type >= 0)
+		cur_lockwait += ozw_now_ns() - start;
+}
+
+const char *ozw_type_name(int type)
+{
+	switch (type) {
+	case Notification::Type_ValueAdded:
+		return "ValueAdded";
+	case Notification::Type_ValueRemoved:
+		return "ValueRemoved";
+	case Notification::Type_ValueChanged:
+		return "ValueChanged";
+	case Notification::Type_ValueRefreshed:
+		return "ValueRefreshed";
+	case Notification::Type_Group:
+		return "Group";
+	case Notification::Type_NodeNew:
+		return "NodeNew";
+	case Notification::Type_NodeAdded:
+		return "NodeAdded";
+	case Notification::Type_NodeRemoved:
+		return "NodeRemoved";
+	case Notification::Type_NodeProtocolInfo:
+		return "NodeProtocolInfo";
+	case Notification::Type_NodeNaming:
+		return "NodeNaming";
+	case Notification::Type_NodeEvent:
+		return "NodeEvent";
+	case Notification::Type_PollingDisabled:
+		return "PollingDisabled";
+	case Notification::Type_PollingEnabled:
+		return "PollingEnabled";
+	case Notification::Type_SceneEvent:
+		return "SceneEvent";
+	case Notification::Type_CreateButton:
+		return "CreateButton";
+	case Notification::Type_DeleteButton:
+		return "DeleteButton";
+	case Notification::Type_ButtonOn:
+		return "ButtonOn";
+	case Notification::Type_ButtonOff:
+		return "ButtonOff";
+	case Notification::Type_DriverReady:
+		return "DriverReady";
+	case Notification::Type_DriverFailed:
+		return "DriverFailed";
+	case Notification::Type_DriverReset:
+		return "DriverReset";
+	case Notification::Type_EssentialNodeQueriesComplete:
+		return "EssentialNodeQueriesComplete";
+	case Notification::Type_NodeQueriesComplete:
+		return "NodeQueriesComplete";
+	case Notification::Type_AwakeNodesQueried:
+		return "AwakeNodesQueried";
+	case Notification::Type_AllNodesQueriedSomeDead:
+		return "AllNodesQueriedSomeDead";
+	case Notification::Type_AllNodesQueried:
+		return "AllNodesQueried";
+	case Notification::Type_Notification:
+		return "Notification";
+	case Notification::Type_DriverRemoved:
+		return "DriverRemoved";
+	default:
+		return NULL;
+	}
+}
+
+void ozw_stats_report(FILE *f)
+{
+	uint64_t total = 0, total_ns = 0;
+	int i;
+
+	fprintf(f, "%-28s %10s %12s %12s %12s %12s\n", "Notification",
+		"count", "avg us", "max us", "lock avg us", "lock max us");
+
+	for (i = 0; i < OZW_NOTIFICATION_TYPES; i++) {
+		struct type_stats *ts = &stats[i];
+		uint64_t count = __atomic_load_n(&ts->count, __ATOMIC_RELAXED);
+		uint64_t handler = __atomic_load_n(&ts->handler_ns,
+						   __ATOMIC_RELAXED);
+		uint64_t lockwait = __atomic_load_n(&ts->lockwait_ns,
+						    __ATOMIC_RELAXED);
+		const char *name = ozw_type_name(i);
+		string label = name ? name : stringf("Type %d", i);
+
+		if (!count)
+			continue;
+
+		fprintf(f, "%-28s %10llu %12.1f %12.1f %12.1f %12.1f\n",
+			label.c_str(), (unsigned long long)count,
+			handler / 1000.0 / count,
+			__atomic_load_n(&ts->handler_max_ns,
+					__ATOMIC_RELAXED) / 1000.0,
+			lockwait / 1000.0 / count,
+			__atomic_load_n(&ts->lockwait_max_ns,
+					__ATOMIC_RELAXED) / 1000.0);
+
+		total += count;
+		total_ns += handler;
+	}
+
+	fprintf(f, "%-28s %10llu %12.1f\n", "Total",
+		(unsigned long long)total,
+		total ? total_ns / 1000.0 / total : 0.0);
+	fflush(f);
+}
+
+static void *stats_signal_thread(void *arg)
+{
+	sigset_t *set = (sigset_t *)arg;
+	int sig;
+
+	for (;;) {
+		if (sigwait(set, &sig) != 0)
+			continue;
+		ozw_stats_report(stderr);
+		ozw_trace_write();
+	}
+
+	return NULL;
+}
+
+//
+// Dump a report (and the trace so far, if we're tracing) whenever we
+// get SIGUSR1.  This needs to be called
+// before OpenZWave starts its threads, so that they inherit the
+// blocked signal mask and the signal is always picked up by our
+// sigwait() thread instead.  A tool starting threads of its own
+// before ozw_setup() calls it first; later calls do nothing.
+//
+void ozw_stats_init(void)
+{
+	static sigset_t set;
+	static bool started = false;
+	pthread_t thread;
+
+	if (started)
+		return;
+	started = true;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	if (pthread_create(&thread, NULL, stats_signal_thread, &set) == 0)
+		pthread_detach(thread);
+}
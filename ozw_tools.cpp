@@ -27,48 +27,331 @@
 
 using namespace OpenZWave;
 
-Manager *ozw_setup(const string port,
-		   Manager::pfnOnNotification_t watcher, void *ctx)
+static bool stats_report = false;
+static bool warm_start = false;
+static int save_log_level = LogLevel_Detail;
+static int queue_log_level = LogLevel_Debug;
+static int dump_log_level = LogLevel_Warning;
+
+static list<string> ports;
+static string config_dir = OZW_CONFIG_DIR;
+
+static Manager::pfnOnNotification_t tool_watcher;
+static void *tool_ctx;
+
+// Per-controller shards, indexed in the order their drivers become
+// ready.  Entries are only ever appended, and num_shards is published
+// after the entry is filled in, so lookups don't need a lock.
+static uint32_t shard_hids[OZW_MAX_DRIVERS];
+static bool shard_scanned[OZW_MAX_DRIVERS];
+
+// Values still to come back from the cache on a warm start, only
+// touched from the shard's own driver thread
+static int warm_pending[OZW_MAX_DRIVERS];
+static int num_shards;
+static pthread_mutex_t shard_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static bool parse_log_levels(const char *arg)
+{
+	string s = arg;
+	size_t comma = s.find(','), comma2;
+
+	if (comma == string::npos) {
+		if (!ozw_parse_log_level(s.c_str(), &save_log_level))
+			return false;
+		// Don't bother queueing more than we save, unless asked
+		queue_log_level = save_log_level;
+		return true;
+	}
+
+	if (!ozw_parse_log_level(s.substr(0, comma).c_str(), &save_log_level))
+		return false;
+
+	comma2 = s.find(',', comma + 1);
+	if (comma2 == string::npos)
+		return ozw_parse_log_level(s.substr(comma + 1).c_str(),
+					   &queue_log_level);
+
+	return ozw_parse_log_level(s.substr(comma + 1, comma2 - comma - 1).c_str(),
+				   &queue_log_level)
+		&& ozw_parse_log_level(s.substr(comma2 + 1).c_str(),
+				       &dump_log_level);
+}
+
+bool ozw_common_option(int opt, const char *arg)
+{
+	switch (opt) {
+	case 'p':
+		if (ports.size() >= OZW_MAX_DRIVERS)
+			return false;
+		ports.push_back(arg);
+		return true;
+	case 'N':
+		stats_report = true;
+		return true;
+	case 'T':
+		ozw_trace_open(arg);
+		return true;
+	case 'l':
+		return parse_log_levels(arg);
+	case 'C':
+		// e.g. one pruned to our devices by mkozwcfg
+		config_dir = arg;
+		return true;
+	case 'w':
+		warm_start = true;
+		return true;
+	default:
+		return false;
+	}
+}
+
+int ozw_num_drivers(void)
+{
+	return ports.size();
+}
+
+bool ozw_warm_start(void)
+{
+	return warm_start;
+}
+
+//-----------------------------------------------------------------------------
+// <ozw_shard>
+// Return the index of the controller with the given home id, or -1
+// if its driver isn't ready yet
+//-----------------------------------------------------------------------------
+int ozw_shard(uint32_t hid)
+{
+	int n = __atomic_load_n(&num_shards, __ATOMIC_ACQUIRE);
+	int i;
+
+	for (i = 0; i < n; i++)
+		if (shard_hids[i] == hid)
+			return i;
+
+	return -1;
+}
+
+int ozw_num_shards(void)
+{
+	return __atomic_load_n(&num_shards, __ATOMIC_ACQUIRE);
+}
+
+uint32_t ozw_shard_home_id(int shard)
+{
+	assert(shard < ozw_num_shards());
+	return shard_hids[shard];
+}
+
+static void add_shard(uint32_t hid)
+{
+	pthread_mutex_lock(&shard_mutex);
+	if ((ozw_shard(hid) < 0) && (num_shards < OZW_MAX_DRIVERS)) {
+		shard_hids[num_shards] = hid;
+		__atomic_store_n(&num_shards, num_shards + 1,
+				 __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&shard_mutex);
+}
+
+static void set_scanned(int shard)
+{
+	if (shard >= 0)
+		__atomic_store_n(&shard_scanned[shard], true, __ATOMIC_RELEASE);
+}
+
+bool ozw_shard_scanned(int shard)
+{
+	return __atomic_load_n(&shard_scanned[shard], __ATOMIC_ACQUIRE);
+}
+
+//-----------------------------------------------------------------------------
+// <warm_load>
+// Read the cached config for a controller's network, which OpenZWave
+// is about to load.  Returns how many values it will add from it, or
+// 0 if there's no cache.  Whether each node sleeps is in there too,
+// and we'd otherwise only learn that when the node's been queried.
+//-----------------------------------------------------------------------------
+static int warm_load(uint32_t hid)
+{
+	string text;
+	size_t pos = 0;
+	XmlTag tag;
+	vector<string> open;	// elements we're inside
+	int nvalues = 0;
+
+	if (!read_file(stringf(OZW_CACHE_DIR "/zwcfg_0x%08x.xml", hid), &text))
+		return 0;
+
+	while (next_xml_tag(text, &pos, &tag)) {
+		if (tag.name[0] == '/') {
+			if (!open.empty())
+				open.pop_back();
+			continue;
+		}
+
+		// Association groups list their members as <Node>s
+		// too, so only take those directly under <Driver>
+		if ((tag.name == "Node") && !open.empty()
+		    && (open.back() == "Driver"))
+			ozw_node_cached(hid, strtoul(tag.attrs["id"].c_str(),
+						     NULL, 0),
+					(tag.attrs["listening"] == "true")
+					|| (tag.attrs["frequentListening"]
+					    == "true"));
+		else if (tag.name == "Value")
+			nvalues++;
+
+		if (!tag.empty)
+			open.push_back(tag.name);
+	}
+
+	return nvalues;
+}
+
+//-----------------------------------------------------------------------------
+// <ozw_all_scanned>
+// Have all our controllers finished (at least) querying their awake
+// nodes?
+//-----------------------------------------------------------------------------
+bool ozw_all_scanned(void)
+{
+	int n = __atomic_load_n(&num_shards, __ATOMIC_ACQUIRE);
+	int i;
+
+	if (n < ozw_num_drivers())
+		return false;
+
+	for (i = 0; i < n; i++)
+		if (!__atomic_load_n(&shard_scanned[i], __ATOMIC_ACQUIRE))
+			return false;
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// <ozw_watcher>
+// Wraps the tool's notification callback with the instrumentation
+//-----------------------------------------------------------------------------
+static void ozw_watcher(Notification const *n, void *ctx)
+{
+	uint64_t start = ozw_now_ns();
+	int shard;
+
+	ozw_stats_begin(n);
+
+	switch (n->GetType()) {
+	case Notification::Type_DriverReady:
+		add_shard(n->GetHomeId());
+		shard = ozw_shard(n->GetHomeId());
+		if (warm_start && (shard >= 0))
+			warm_pending[shard] = warm_load(n->GetHomeId());
+		break;
+
+	case Notification::Type_ValueAdded:
+		// On a warm start, we're as good as scanned once
+		// everything in the cache is back.  OpenZWave carries on
+		// querying the nodes in the background.
+		shard = ozw_shard(n->GetHomeId());
+		if ((shard >= 0) && (warm_pending[shard] > 0)
+		    && (--warm_pending[shard] == 0))
+			set_scanned(shard);
+		break;
+
+	case Notification::Type_AwakeNodesQueried:
+	case Notification::Type_AllNodesQueried:
+	case Notification::Type_AllNodesQueriedSomeDead:
+		set_scanned(ozw_shard(n->GetHomeId()));
+		break;
+
+	default:
+		break;
+	}
+
+	ozw_nodes_notification(n);
+	ozw_budget_notification(n);
+	tool_watcher(n, tool_ctx);
+	ozw_stats_end(start);
+	ozw_trace_notification(n, start);
+}
+
+Manager *ozw_setup(Manager::pfnOnNotification_t watcher, void *ctx)
 {
 	Manager *mgr;
+	uint64_t start;
+
+	tool_watcher = watcher;
+	tool_ctx = ctx;
+
+	ozw_stats_init();
 
 	// Create the OpenZWave Manager.
 	// The first argument is the path to the config files (where the manufacturer_specific.xml file is located
 	// The second argument is the path for saved Z-Wave network state and the log file.  If you leave it NULL 
 	// the log file will appear in the program's working directory.
-	Options::Create(OZW_CONFIG_DIR, OZW_CACHE_DIR, "");
-	Options::Get()->AddOptionInt("SaveLogLevel", LogLevel_Detail);
-	Options::Get()->AddOptionInt("QueueLogLevel", LogLevel_Debug);
+	start = ozw_now_ns();
+	Options::Create(config_dir, OZW_CACHE_DIR, "");
+	Options::Get()->AddOptionInt("SaveLogLevel", save_log_level);
+	Options::Get()->AddOptionInt("QueueLogLevel", queue_log_level);
+	Options::Get()->AddOptionInt("DumpTriggerLevel", dump_log_level);
 	Options::Get()->AddOptionBool("ConsoleOutput", false);
 	Options::Get()->Lock();
+	ozw_trace_span("Options::Create", start);
 
+	start = ozw_now_ns();
+	ozw_log_init(OZW_LOG_MAX_SIZE, save_log_level, queue_log_level,
+		     dump_log_level);
 	Manager::Create();
 	mgr = Manager::Get();
+	ozw_trace_span("Manager::Create", start);
 
 	// Add a callback handler to the manager.  The second argument is a context that
 	// is passed to the OnNotification method.  If the OnNotification is a method of
 	// a class, the context would usually be a pointer to that class object, to
 	// avoid the need for the notification handler to be a static.
-	mgr->AddWatcher(watcher, NULL);
-
-	// Add a Z-Wave Driver
-	// Modify this line to set the correct serial port for your PC interface.
-	if (strcasecmp(port.c_str(), "usb") == 0) {
-		mgr->AddDriver("HID Controller",
-			       Driver::ControllerInterface_Hid);
-	} else {
-		mgr->AddDriver(port);
+	mgr->AddWatcher(ozw_watcher, NULL);
+
+	// Add a Z-Wave Driver for each controller.  They all share
+	// this manager, and so the parsed device configuration.
+	if (ports.empty())
+		ports.push_back(OZW_DEFAULT_DEV);
+
+	start = ozw_now_ns();
+	ozw_trace_scan_start();
+	for (list<string>::iterator it = ports.begin();
+	     it != ports.end(); it++) {
+		if (strcasecmp(it->c_str(), "usb") == 0) {
+			mgr->AddDriver("HID Controller",
+				       Driver::ControllerInterface_Hid);
+		} else {
+			mgr->AddDriver(*it);
+		}
 	}
+	ozw_trace_span("AddDriver", start);
 
 	return mgr;
 }
 
+void ozw_remove_watcher(Manager *mgr)
+{
+	mgr->RemoveWatcher(ozw_watcher, NULL);
+}
+
 void ozw_cleanup(Manager *mgr)
 {
+	uint64_t start = ozw_now_ns();
+
 	assert(mgr == Manager::Get());
 
 	Manager::Destroy();
+	ozw_trace_span("Manager::Destroy", start);
 	Options::Destroy();
+
+	ozw_trace_write();
+
+	if (stats_report)
+		ozw_stats_report(stderr);
 }
 
 string stringf(const char *fmt, ...)
@@ -154,6 +437,89 @@ bool parse_vid(const string s,
 	
 }
 
+bool read_file(const string &path, string *text)
+{
+	FILE *f = fopen(path.c_str(), "r");
+	char buf[4096];
+	size_t n;
+
+	if (!f)
+		return false;
+
+	text->clear();
+	while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+		text->append(buf, n);
+	fclose(f);
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// <next_xml_tag>
+// Find the next element tag in text from *pos, skipping comments,
+// declarations and processing instructions
+//-----------------------------------------------------------------------------
+bool next_xml_tag(const string &text, size_t *pos, XmlTag *tag)
+{
+	size_t p, q;
+
+	for (;;) {
+		p = text.find('<', *pos);
+		if (p == string::npos)
+			return false;
+
+		if (text.compare(p, 4, "<!--") == 0) {
+			q = text.find("-->", p);
+			if (q == string::npos)
+				return false;
+			*pos = q + 3;
+			continue;
+		}
+
+		q = text.find('>', p);
+		if (q == string::npos)
+			return false;
+		*pos = q + 1;
+
+		if ((text[p + 1] != '?') && (text[p + 1] != '!'))
+			break;
+	}
+
+	tag->start = p;
+	tag->end = q + 1;
+	tag->empty = (text[q - 1] == '/');
+	tag->attrs.clear();
+
+	p++;
+	q = text.find_first_of(" \t\r\n/>", p + 1);
+	tag->name = text.substr(p, q - p);
+
+	// name="value" pairs, up to the end of the tag
+	for (p = q; p < tag->end; ) {
+		size_t eq, open, close;
+
+		p = text.find_first_not_of(" \t\r\n/", p);
+		if ((p == string::npos) || (p >= tag->end - 1))
+			break;
+
+		eq = text.find('=', p);
+		if ((eq == string::npos) || (eq >= tag->end))
+			break;
+		open = text.find_first_of("\"'", eq);
+		if ((open == string::npos) || (open >= tag->end))
+			break;
+		close = text.find(text[open], open + 1);
+		if ((close == string::npos) || (close >= tag->end))
+			break;
+
+		tag->attrs[text.substr(p, text.find_first_of(" \t\r\n=", p) - p)]
+			= text.substr(open + 1, close - open - 1);
+		p = close + 1;
+	}
+
+	return true;
+}
+
 ValueMatcher::ValueMatcher(string nstr, string vstr)
 {
 	ok = true;
@@ -172,12 +538,46 @@ bool ValueMatcher::valid(void)
 
 bool ValueMatcher::matches(OpenZWave::Notification const *n)
 {
-	if ((n->GetHomeId() == hid) && (n->GetNodeId() == nid)
-	    && (n->GetValueID().GetInstance() == instance)
-	    && (n->GetValueID().GetCommandClassId() == ccid)
-	    && (n->GetValueID().GetIndex() == index)) {
+	return matches(n->GetValueID());
+}
+
+bool ValueMatcher::matches(OpenZWave::ValueID const &vid)
+{
+	if ((vid.GetHomeId() == hid) && (vid.GetNodeId() == nid)
+	    && (vid.GetInstance() == instance)
+	    && (vid.GetCommandClassId() == ccid)
+	    && (vid.GetIndex() == index)) {
 		return true;
 	}
 
 	return false;
 }
+
+//-----------------------------------------------------------------------------
+// <ozw_pack_value_key>
+// Pack the ids identifying a value into one integer, ordered by home,
+// node, command class, instance then index
+//-----------------------------------------------------------------------------
+uint64_t ozw_pack_value_key(uint32_t hid, uint8_t nid, uint8_t instance,
+			    uint8_t ccid, uint8_t index)
+{
+	return ((uint64_t)hid << 32) | ((uint64_t)nid << 24)
+		| ((uint64_t)ccid << 16) | ((uint64_t)instance << 8) | index;
+}
+
+//-----------------------------------------------------------------------------
+// <ValueMatcher::key>
+// The ids a matcher compares, packed so that a matching value has the
+// same ozw_value_key(), for looking it up directly
+//-----------------------------------------------------------------------------
+uint64_t ValueMatcher::key(void)
+{
+	return ozw_pack_value_key(hid, nid, instance, ccid, index);
+}
+
+uint64_t ozw_value_key(ValueID const &vid)
+{
+	return ozw_pack_value_key(vid.GetHomeId(), vid.GetNodeId(),
+				  vid.GetInstance(), vid.GetCommandClassId(),
+				  vid.GetIndex());
+}
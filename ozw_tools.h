@@ -19,6 +19,11 @@
 #ifndef _OZW_TOOLS_H
 #define _OZW_TOOLS_H
 
+#include <pthread.h>
+#include <stdlib.h>
+#include <coroutine>
+#include <new>
+
 #include <Options.h>
 #include <Manager.h>
 #include <Driver.h>
@@ -34,11 +39,136 @@
 #define OZW_CACHE_DIR		"/var/cache/ozw-tools"
 #define OZW_DEFAULT_DEV		"/dev/zwave"
 
-OpenZWave::Manager *ozw_setup(const std::string port,
-			      OpenZWave::Manager::pfnOnNotification_t watcher,
+// getopt() options understood by ozw_common_option(), which every
+// tool should include in its own option string
+#define OZW_COMMON_OPTS		"p:NT:l:C:w"
+#define OZW_COMMON_USAGE	"[-p port]... [-N] [-T trace file] [-l save level[,queue level[,dump level]]] [-C config dir] [-w]"
+
+// Most controllers we'll manage from one process
+#define OZW_MAX_DRIVERS		8
+
+#define OZW_LOG_MAX_SIZE	(1024 * 1024)
+
+bool ozw_common_option(int opt, const char *arg);
+
+OpenZWave::Manager *ozw_setup(OpenZWave::Manager::pfnOnNotification_t watcher,
 			      void *ctx = NULL);
+int ozw_num_drivers(void);
+bool ozw_warm_start(void);
+int ozw_shard(uint32_t hid);
+int ozw_num_shards(void);
+uint32_t ozw_shard_home_id(int shard);
+bool ozw_shard_scanned(int shard);
+bool ozw_all_scanned(void);
+void ozw_remove_watcher(OpenZWave::Manager *mgr);
 void ozw_cleanup(OpenZWave::Manager *mgr);
 
+// Notification instrumentation (ozw_stats.cpp)
+#define OZW_NOTIFICATION_TYPES	32
+
+uint64_t ozw_now_ns(void);
+void ozw_lock(pthread_mutex_t *mutex);
+const char *ozw_type_name(int type);
+void ozw_stats_init(void);
+void ozw_stats_begin(OpenZWave::Notification const *n);
+void ozw_stats_end(uint64_t start);
+void ozw_stats_report(FILE *f);
+size_t ozw_rss_bytes(void);
+
+// Asynchronous OpenZWave log sink (ozw_log.cpp)
+bool ozw_parse_log_level(const char *s, int *levelp);
+void ozw_log_init(long max_size, int save, int queue, int dump);
+
+// Node sleep tracking and wake-up scheduling (ozw_nodes.cpp)
+bool ozw_node_sleeps(uint32_t hid, uint8_t nid);
+bool ozw_node_awake(uint32_t hid, uint8_t nid);
+void ozw_refresh_value(OpenZWave::Manager *mgr,
+		       OpenZWave::ValueID const &vid);
+void ozw_poll_on_wake(OpenZWave::ValueID const &vid, bool enable);
+void ozw_node_cached(uint32_t hid, uint8_t nid, bool listening);
+void ozw_nodes_notification(OpenZWave::Notification const *n);
+
+// Startup phase tracing (ozw_trace.cpp)
+bool ozw_trace_enabled(void);
+void ozw_trace_open(const char *file);
+void ozw_trace_span(const char *name, uint64_t start_ns);
+void ozw_trace_scan_start(void);
+void ozw_trace_notification(OpenZWave::Notification const *n,
+			    uint64_t start_ns);
+void ozw_trace_write(void);
+
+// Airtime budget for polls (ozw_budget.cpp)
+struct OzwBudgetStats {
+	size_t queued;			// polls waiting to go out
+	unsigned polls_out;		// sent and not yet answered
+	unsigned interactive_out;
+
+	// Since the last sample
+	unsigned long polls;
+	uint64_t wait_ns;		// total time polls spent queued
+	uint64_t wait_max_ns;
+	unsigned long interactive;
+	uint64_t interactive_ns;	// total time to answer
+	uint64_t interactive_max_ns;
+};
+
+void ozw_budget_init(unsigned per_controller, unsigned per_node);
+bool ozw_budget_enabled(void);
+void ozw_budget_poll(OpenZWave::ValueID const &vid);
+void ozw_budget_interactive(OpenZWave::ValueID const &vid);
+void ozw_budget_notification(OpenZWave::Notification const *n);
+void ozw_budget_sample(uint32_t hid, OzwBudgetStats *st);
+
+// Metrics derived from a value's samples (ozw_metrics.cpp)
+enum {
+	METRIC_RAW = 0x01,
+	METRIC_RATE = 0x02,		// change per second
+	METRIC_COUNTER = 0x04,		// increase per second, across resets
+	METRIC_INTEGRAL = 0x08,		// value times seconds
+	METRIC_EWMA = 0x10,
+};
+
+struct MetricSpec {
+	unsigned mask;
+	double ewma_tau;		// time constant, in seconds
+};
+
+bool parse_metrics(const std::string s, MetricSpec *spec);
+vector<std::string> metric_list(MetricSpec const &spec);
+bool ozw_value_as_double(OpenZWave::Manager *mgr,
+			 OpenZWave::ValueID const &vid, double *d);
+
+class DerivedMetrics {
+public:
+	unsigned long samples;
+	double rate;		// rates need two samples
+	double counter_rate;
+	unsigned long resets;
+	double integral;
+	double ewma;
+
+	DerivedMetrics();
+	void sample(double v, uint64_t ns, double ewma_tau);
+
+private:
+	double last;
+	uint64_t last_ns;
+};
+
+// Threshold rules evaluated as values arrive (ozw_rules.cpp)
+bool ozw_rules_load(const char *file, FILE *sink);
+void ozw_rules_value_added(OpenZWave::ValueID const &vid);
+void ozw_rules_value_removed(OpenZWave::ValueID const &vid);
+void ozw_rules_sample(OpenZWave::Manager *mgr, OpenZWave::ValueID const &vid);
+double ozw_rules_benchmark(unsigned long samples);
+double ozw_rules_benchmark_read(OpenZWave::Manager *mgr,
+				unsigned long samples, size_t *nvalues);
+
+// Unix socket publish/subscribe of value updates (ozw_pubsub.cpp)
+bool ozw_pubsub_start(const char *path);
+void ozw_pubsub_publish(OpenZWave::ValueID const &vid, const std::string &line);
+void ozw_pubsub_stop(void);
+
 std::string stringf(const char *fmt, ...);
 std::string format_znode(uint32_t hid, uint8_t nid);
 bool parse_znode(const std::string s, uint32_t *hidp, uint8_t *nidp);
@@ -46,6 +176,18 @@ std::string format_vid(const OpenZWave::ValueID vid);
 bool parse_vid(const std::string s,
 	       uint8_t *instancep, uint8_t *ccidp, uint8_t *indexp);
 
+bool read_file(const std::string &path, std::string *text);
+
+// Just enough of an XML tag for reading OpenZWave's config files
+struct XmlTag {
+	std::string name;	// with a leading '/' for end tags
+	map<std::string, std::string> attrs;
+	bool empty;		// <tag ... />
+	size_t start, end;	// where the whole tag sits in the text
+};
+
+bool next_xml_tag(const std::string &text, size_t *pos, XmlTag *tag);
+
 class ValueMatcher {
 private:
 	bool ok;
@@ -58,6 +200,178 @@ public:
 	ValueMatcher(std::string nstr, std::string vstr);
 	bool valid(void);
 	bool matches(OpenZWave::Notification const *n);
+	bool matches(OpenZWave::ValueID const &vid);
+	uint64_t key(void);
 };
 
+uint64_t ozw_pack_value_key(uint32_t hid, uint8_t nid, uint8_t instance,
+			    uint8_t ccid, uint8_t index);
+uint64_t ozw_value_key(OpenZWave::ValueID const &vid);
+
+// A notification, decoded into the fields handlers actually use
+struct ZWaveEvent {
+	int type;
+	uint32_t hid;
+	uint8_t nid;
+	OpenZWave::ValueID vid;
+	uint8_t code;		// notification code, or node event
+	OpenZWave::Notification const *n;
+};
+
+// Routes notifications to handlers registered by type, and
+// optionally by home and node id (ozw_dispatch.cpp).  Pass
+// NotificationDispatcher::dispatch and the dispatcher to ozw_setup().
+class NotificationDispatcher {
+public:
+	typedef void (*handler_t)(ZWaveEvent const *ev);
+
+	// If mutex is given, handlers are called with it held
+	NotificationDispatcher(pthread_mutex_t *mutex = NULL);
+	void on(int type, handler_t handler, uint32_t hid = 0,
+		uint8_t nid_min = 0, uint8_t nid_max = 0xff);
+	void on_all(handler_t handler);
+	void on_scanned(handler_t handler);
+
+	static void dispatch(OpenZWave::Notification const *n, void *ctx);
+
+private:
+	struct Registration {
+		int type;
+		handler_t handler;
+		uint32_t hid;
+		uint8_t nid_min, nid_max;
+	};
+
+	// Homes and nodes anything's registered for, by type
+	struct TypeRange {
+		uint32_t hid;		// 0 for any
+		uint8_t nid_min, nid_max;
+	};
+
+	pthread_mutex_t *mutex;
+	uint32_t type_mask;
+	TypeRange ranges[OZW_NOTIFICATION_TYPES];
+	vector<Registration> handlers;
+	handler_t scanned_handler;
+	bool scanned;
+};
+
+// Fixed size object pool (ozw_pool.cpp).  Memory is taken from the
+// system a chunk at a time, and reused but never given back, so a
+// pool only ever grows to the most objects live at once.  Not thread
+// safe, callers supply their own locking.
+class Pool {
+public:
+	Pool(size_t size, size_t per_chunk = 64);
+	~Pool();
+	void *alloc(void);
+	void free(void *p);
+	size_t live(void) { return nlive; }
+	size_t bytes(void) { return nbytes; }
+
+private:
+	struct FreeObj {
+		FreeObj *next;
+	};
+
+	size_t size;
+	size_t per_chunk;
+	size_t nlive;
+	size_t nbytes;
+	FreeObj *free_list;
+	vector<void *> chunks;
+
+	Pool(const Pool &);
+	Pool &operator=(const Pool &);
+};
+
+template <class T> class ObjectPool : public Pool {
+public:
+	ObjectPool() : Pool(sizeof(T)) {}
+	T *get(void) { return new (alloc()) T(); }
+	void put(T *p)
+	{
+		p->~T();
+		free(p);
+	}
+};
+
+// Coroutine layer over the notification stream (ozw_async.cpp).
+// Every task runs on the thread in ozw_async_run(), one at a time, so
+// a task awaiting an event only holds up itself.
+enum AsyncStatus {
+	ASYNC_OK,
+	ASYNC_TIMEOUT,
+	ASYNC_CANCELLED,
+	ASYNC_FAILED,		// a driver failed
+	ASYNC_NOTFOUND,		// scan finished without a matching value
+	ASYNC_REMOVED,		// value went away
+};
+
+// Cancels every wait it was passed to, see ozw_async_cancel()
+struct AsyncCancel {
+	bool cancelled;
+
+	AsyncCancel() : cancelled(false) {}
+};
+
+// A coroutine run by ozw_async_spawn().  Nothing waits on its result,
+// so tasks report back through whatever state they were handed.
+class AsyncTask {
+public:
+	struct promise_type {
+		~promise_type();
+		AsyncTask get_return_object(void)
+		{
+			return AsyncTask(std::coroutine_handle<promise_type>::from_promise(*this));
+		}
+		std::suspend_always initial_suspend(void) noexcept { return {}; }
+		std::suspend_never final_suspend(void) noexcept { return {}; }
+		void return_void(void) {}
+		void unhandled_exception(void) { abort(); }
+	};
+
+	std::coroutine_handle<> handle;
+
+private:
+	explicit AsyncTask(std::coroutine_handle<> h) : handle(h) {}
+};
+
+// What co_await on one of the ozw_*() waits below gives you
+class AsyncWait {
+public:
+	enum { SCAN, ADDED, CHANGED, SLEEP };
+
+	int kind;
+	ValueMatcher *matcher;
+	OpenZWave::ValueID vid;
+	OpenZWave::ValueID *vidp;
+	uint64_t *seq;
+	uint64_t deadline;
+	AsyncCancel *cancel;
+	std::coroutine_handle<> handle;
+	AsyncStatus status;
+
+	AsyncWait(int kind, uint64_t timeout_ns, AsyncCancel *cancel);
+	bool await_ready(void) { return false; }
+	bool await_suspend(std::coroutine_handle<> h);
+	AsyncStatus await_resume(void) { return status; }
+};
+
+void ozw_async_attach(NotificationDispatcher *d);
+void ozw_async_spawn(AsyncTask task);
+void ozw_async_run(void);
+void ozw_async_cancel(AsyncCancel *cancel);
+uint64_t ozw_value_seq(OpenZWave::ValueID const &vid);
+
+// A timeout of 0 waits for ever
+AsyncWait ozw_scan_complete(uint64_t timeout_ns = 0,
+			    AsyncCancel *cancel = NULL);
+AsyncWait ozw_value_added(ValueMatcher *matcher, OpenZWave::ValueID *vidp,
+			  uint64_t timeout_ns = 0, AsyncCancel *cancel = NULL);
+AsyncWait ozw_value_changed(OpenZWave::ValueID const &vid, uint64_t *seq,
+			    uint64_t timeout_ns = 0,
+			    AsyncCancel *cancel = NULL);
+AsyncWait ozw_sleep(uint64_t ns, AsyncCancel *cancel = NULL);
+
 #endif /* _OZW_TOOLS_H */
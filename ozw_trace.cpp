@@ -0,0 +1,221 @@
+//
+// ozw_trace - Startup phase tracing, in Chrome trace-event format
+//
+// Copyright David Gibson 2015 <ozw@gibson.dropbear.id.au>
+//
+// This program is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see
+// <http://www.gnu.org/licenses/>.
+//
+// The output can be loaded into chrome://tracing or Perfetto.  Phases
+// of the tool itself go on one track, notification handlers on
+// another, and each node gets its own track showing its interview.
+//
+#include <pthread.h>
+
+#include "ozw_tools.h"
+
+using namespace OpenZWave;
+
+#define TRACE_TID_PHASES	0
+#define TRACE_TID_HANDLERS	1
+#define TRACE_TID_NODE(shard, nid) \
+	(0x1000 + (shard) * 0x100 + (nid))
+
+// Handler spans stop once we've scanned, but whatever a long-running
+// tool does after that, don't hold more than this
+#define TRACE_MAX_EVENTS	100000
+
+struct trace_event {
+	string name;
+	int tid;
+	uint64_t start_ns;
+	uint64_t dur_ns;
+};
+
+static string trace_file;
+static uint64_t trace_base_ns;
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static vector<trace_event> trace_events;
+static unsigned long trace_dropped;
+static map<int, string> trace_tracks;
+static map<int, uint64_t> node_start;
+static uint64_t scan_start;
+
+bool ozw_trace_enabled(void)
+{
+	return !trace_file.empty();
+}
+
+void ozw_trace_open(const char *file)
+{
+	trace_file = file;
+	trace_base_ns = ozw_now_ns();
+	trace_tracks[TRACE_TID_PHASES] = "phases";
+	trace_tracks[TRACE_TID_HANDLERS] = "notifications";
+}
+
+static void trace_add(const string &name, int tid,
+		      uint64_t start_ns, uint64_t end_ns)
+{
+	trace_event ev;
+
+	ev.name = name;
+	ev.tid = tid;
+	ev.start_ns = start_ns;
+	ev.dur_ns = end_ns - start_ns;
+
+	pthread_mutex_lock(&trace_mutex);
+	if (trace_events.size() < TRACE_MAX_EVENTS)
+		trace_events.push_back(ev);
+	else
+		trace_dropped++;
+	pthread_mutex_unlock(&trace_mutex);
+}
+
+void ozw_trace_span(const char *name, uint64_t start_ns)
+{
+	if (!ozw_trace_enabled())
+		return;
+
+	trace_add(name, TRACE_TID_PHASES, start_ns, ozw_now_ns());
+}
+
+void ozw_trace_scan_start(void)
+{
+	scan_start = ozw_now_ns();
+}
+
+//-----------------------------------------------------------------------------
+// <ozw_trace_notification>
+// Record the handler span for a notification, while we're still
+// starting up, plus whatever phase boundary it represents
+//-----------------------------------------------------------------------------
+void ozw_trace_notification(Notification const *n, uint64_t start_ns)
+{
+	uint32_t hid = n->GetHomeId();
+	uint8_t nid = n->GetNodeId();
+	int shard = ozw_shard(hid);
+	int tid;
+	string span;
+	int span_tid = TRACE_TID_PHASES;
+	uint64_t span_start = scan_start;
+	uint64_t now;
+	const char *name;
+
+	if (!ozw_trace_enabled())
+		return;
+
+	// Home ids can share their low bits, so each controller's
+	// nodes are kept apart by shard, or after them all if it's
+	// not got one yet
+	if (shard < 0)
+		shard = OZW_MAX_DRIVERS;
+	tid = TRACE_TID_NODE(shard, nid);
+
+	now = ozw_now_ns();
+	name = ozw_type_name(n->GetType());
+	if (!name)
+		name = "Unknown";
+	if (!ozw_all_scanned())
+		trace_add(name, TRACE_TID_HANDLERS, start_ns, now);
+
+	pthread_mutex_lock(&trace_mutex);
+
+	switch (n->GetType()) {
+	case Notification::Type_NodeAdded:
+		trace_tracks[tid] = "node " + format_znode(hid, nid);
+		node_start[tid] = now;
+		break;
+
+	case Notification::Type_EssentialNodeQueriesComplete:
+		if (node_start.count(tid)) {
+			span = "essential queries";
+			span_tid = tid;
+			span_start = node_start[tid];
+		}
+		break;
+
+	case Notification::Type_NodeQueriesComplete:
+		if (node_start.count(tid)) {
+			span = "interview";
+			span_tid = tid;
+			span_start = node_start[tid];
+			node_start.erase(tid);
+		}
+		break;
+
+	case Notification::Type_DriverReady:
+	case Notification::Type_AwakeNodesQueried:
+	case Notification::Type_AllNodesQueried:
+	case Notification::Type_AllNodesQueriedSomeDead:
+		// Spans from AddDriver up to each of these milestones
+		span = name;
+		break;
+
+	default:
+		break;
+	}
+
+	pthread_mutex_unlock(&trace_mutex);
+
+	if (!span.empty())
+		trace_add(span, span_tid, span_start, now);
+}
+
+void ozw_trace_write(void)
+{
+	FILE *f;
+	bool first = true;
+
+	if (!ozw_trace_enabled())
+		return;
+
+	f = fopen(trace_file.c_str(), "w");
+	if (!f) {
+		perror(trace_file.c_str());
+		return;
+	}
+
+	pthread_mutex_lock(&trace_mutex);
+
+	fprintf(f, "{\"traceEvents\":[\n");
+
+	for (map<int, string>::iterator it = trace_tracks.begin();
+	     it != trace_tracks.end(); it++) {
+		fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\","
+			"\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+			first ? "" : ",\n", it->first, it->second.c_str());
+		first = false;
+	}
+
+	for (vector<trace_event>::iterator it = trace_events.begin();
+	     it != trace_events.end(); it++) {
+		fprintf(f, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,"
+			"\"tid\":%d,\"ts\":%.3f",
+			first ? "" : ",\n", it->name.c_str(), it->tid,
+			(it->start_ns - trace_base_ns) / 1000.0);
+		fprintf(f, ",\"dur\":%.3f}", it->dur_ns / 1000.0);
+		first = false;
+	}
+
+	fprintf(f, "\n]}\n");
+
+	if (trace_dropped)
+		fprintf(stderr, "%s: dropped %lu events\n",
+			trace_file.c_str(), trace_dropped);
+
+	pthread_mutex_unlock(&trace_mutex);
+
+	fclose(f);
+}
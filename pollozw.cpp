@@ -26,34 +26,85 @@
 #include <pthread.h>
 #include <stdarg.h>
 #include <time.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/inotify.h>
+#include <set>
 
 #include "ozw_tools.h"
 
 #define DEFAULT_INTERVAL	10
 
+// A value not heard from in this many poll intervals is stale
+#define STALE_POLLS		2
+
 using namespace OpenZWave;
 
 // Global configuration
-static string zwave_port = OZW_DEFAULT_DEV;
 static int verbose = 0;
 static int debug = 0;
 static unsigned long interval = DEFAULT_INTERVAL;
-static list<ValueMatcher *> matchlist;
+static unsigned long stats_interval = 0;
+static unsigned long snapshot_interval = 0;
+static vector<string> arg_targets;	// from the command line
+static const char *target_file = NULL;
 static string time_fmt = "%c";
 static bool use_utc = false;
+static const char *pubsub_path = NULL;
+static unsigned long budget_controller = 0;	// 0 for OpenZWave polling
+static unsigned long budget_node = 1;
+static const char *rule_file = NULL;
+static const char *event_file = NULL;
+static bool benchmark = false;
+
+// Samples for the rule benchmark, fewer once it's reading each value
+// from OpenZWave
+#define BENCHMARK_SAMPLES	10000000
+#define BENCHMARK_READS		100000
+
+// What we're polling, the command line targets followed by those
+// in the target file.  Changing them needs targets_mutex and every
+// shard lock, reading them needs either.
+static pthread_mutex_t targets_mutex = PTHREAD_MUTEX_INITIALIZER;
+static list<ValueMatcher *> matchlist;
+static vector<MetricSpec> metrics;	// for each matcher
+static vector<string> columns;		// as given, for the snapshot header
+static bool columns_changed = false;
 
 // Global state
 static pthread_mutex_t g_mutex;
-static pthread_cond_t g_cond = PTHREAD_COND_INITIALIZER;
+static AsyncCancel stop;
 
-static bool scanned = false;
-static bool finished = false;
 static bool failed = false;
 
 class ValueInfo {
+public:
+	int column;		// position in the targets
+	MetricSpec metrics;	// what to output
+	DerivedMetrics derived;
+	vector<string> fields;	// latest, for snapshots
+	uint64_t updated_ns;	// when we last heard, 0 if never
 };
 
-static map<ValueID, ValueInfo *> vidmap;
+// Per-controller state.  Each controller's notifications only need
+// its own shard's lock, so controllers don't hold each other up.
+struct Shard {
+	pthread_mutex_t mutex;
+	map<ValueID, ValueInfo *> vidmap;
+	ObjectPool<ValueInfo> pool;	// owns everything in vidmap
+	set<ValueID> known;		// every value, targets or not
+
+	// Previous statistics sample, only used by the main thread
+	uint64_t stats_ns;
+	Driver::DriverData driver_stats;
+	map<uint8_t, Node::NodeData> node_stats;
+};
+
+static Shard shards[OZW_MAX_DRIVERS];
+
+// Serialises output, so that values from all controllers come out in
+// timestamp order
+static pthread_mutex_t out_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 static void pr_debug(int level, const char *fmt, ...)
 	__attribute__((format (printf, 2, 3)));
@@ -89,123 +140,573 @@ static void error(const char *fmt, ...)
 	vfprintf(stderr, fmt, ap);
 	va_end(ap);
 
-	finished = true;
 	failed = true;
-	pthread_cond_broadcast(&g_cond);
+	ozw_async_cancel(&stop);
 
 	pthread_mutex_unlock(&g_mutex);
 }
 
-static void print_value(Manager *mgr, ValueID vid)
+// Called with out_mutex held
+static void format_time(char *buf, size_t len)
 {
 	time_t now;
 	struct tm *now_tm;
+
+	now = time(NULL);
+	if (use_utc)
+		now_tm = gmtime(&now);
+	else
+		now_tm = localtime(&now);
+	strftime(buf, len, time_fmt.c_str(), now_tm);
+}
+
+//-----------------------------------------------------------------------------
+// <format_fields>
+// Format each metric we're outputting for a value, with its units if
+// units isn't NULL.  A metric we can't work out yet, or at all for a
+// value that isn't a number, is '-'.  Called with the shard lock held.
+//-----------------------------------------------------------------------------
+static bool format_fields(Manager *mgr, ValueID const &vid, ValueInfo *vi,
+			  const string *units, vector<string> *fields)
+{
+	DerivedMetrics &d = vi->derived;
+	unsigned mask = vi->metrics.mask;
+	string value;
+
+	fields->clear();
+
+	if (mask & METRIC_RAW) {
+		if (!mgr->GetValueAsString(vid, &value))
+			return false;
+		fields->push_back(units ? value + " " + *units : value);
+	}
+
+#define FIELD(bit, name, ok, v, suffix)					\
+	if (mask & (bit)) {						\
+		string f = (ok) ? stringf("%g", (v)) : "-";		\
+		if (units)						\
+			f = name "=" + f + " " + *units + suffix;	\
+		fields->push_back(f);					\
+	}
+
+	FIELD(METRIC_RATE, "rate", d.samples > 1, d.rate, "/s");
+	FIELD(METRIC_COUNTER, "counter", d.samples > 1, d.counter_rate, "/s");
+	FIELD(METRIC_INTEGRAL, "integral", d.samples > 0, d.integral, "*s");
+	FIELD(METRIC_EWMA, "ewma", d.samples > 0, d.ewma, "");
+
+#undef FIELD
+
+	return true;
+}
+
+static string join(vector<string> &fields)
+{
+	string s;
+
+	for (vector<string>::iterator it = fields.begin();
+	     it != fields.end(); it++)
+		s += ((it == fields.begin()) ? "" : "\t") + *it;
+
+	return s;
+}
+
+//-----------------------------------------------------------------------------
+// <print_value>
+// Print a value as it changes, unless we're printing snapshots
+// instead, and pass it on to any subscribers.  Called with the shard
+// lock held.
+//-----------------------------------------------------------------------------
+static void print_value(Manager *mgr, ValueID vid, ValueInfo *vi)
+{
 	char timestr[128];
 	string label = mgr->GetValueLabel(vid);
 	string units = mgr->GetValueUnits(vid);
-	string value;
+	vector<string> fields, with_units;
 
-	if (!mgr->GetValueAsString(vid, &value)) {
+	if (!format_fields(mgr, vid, vi, NULL, &fields)
+	    || !format_fields(mgr, vid, vi, &units, &with_units)) {
 		error("Unable to read value");
 		return;
 	}
 
-	now = time(NULL);
-	if (use_utc)
-		now_tm = gmtime(&now);
-	else
-		now_tm = localtime(&now);
-	strftime(timestr, sizeof(timestr), time_fmt.c_str(), now_tm);
+	pthread_mutex_lock(&out_mutex);
 
-	if (verbose)
-		printf("%s\t%s\t%s %s\n", timestr, label.c_str(),
-		       value.c_str(), units.c_str());
-	else
-		printf("%s\t%s\n", timestr, value.c_str());
+	format_time(timestr, sizeof(timestr));
+
+	if (snapshot_interval) {
+		// Only going to subscribers
+	} else if (verbose) {
+		printf("%s\t%s\t%s\n", timestr, label.c_str(),
+		       join(with_units).c_str());
+	} else {
+		printf("%s\t%s\n", timestr, join(fields).c_str());
+	}
+
+	if (pubsub_path)
+		ozw_pubsub_publish(vid, stringf("%s\t%s %s\t%s\n", timestr,
+			format_znode(vid.GetHomeId(), vid.GetNodeId()).c_str(),
+			format_vid(vid).c_str(), join(with_units).c_str()));
+
+	pthread_mutex_unlock(&out_mutex);
+}
+
+#define RATE(field)	((cur.field - last.field) / secs)
+
+static void print_driver_stats(const char *timestr, uint32_t hid, double secs,
+			       Driver::DriverData &cur,
+			       Driver::DriverData &last)
+{
+	printf("%s\t%08x\tdriver\tsof=%.2f read=%.2f write=%.2f"
+	       " ackwait=%.2f readaborts=%.2f badchecksum=%.2f"
+	       " retries=%.2f dropped=%.2f callbacks=%.2f"
+	       " noack=%.2f netbusy=%.2f nondelivery=%.2f\n",
+	       timestr, hid, RATE(m_SOFCnt), RATE(m_readCnt), RATE(m_writeCnt),
+	       RATE(m_ACKWaiting), RATE(m_readAborts), RATE(m_badChecksum),
+	       RATE(m_retries), RATE(m_dropped), RATE(m_callbacks),
+	       RATE(m_noack), RATE(m_netbusy), RATE(m_nondelivery));
+}
+
+static void print_node_stats(const char *timestr, uint32_t hid, uint8_t nid,
+			     double secs, Node::NodeData &cur,
+			     Node::NodeData &last)
+{
+	printf("%s\t%s\tnode\tsent=%.2f failed=%.2f retries=%.2f"
+	       " received=%.2f dups=%.2f unsolicited=%.2f rtt=%u\n",
+	       timestr, format_znode(hid, nid).c_str(),
+	       RATE(m_sentCnt), RATE(m_sentFailed), RATE(m_retries),
+	       RATE(m_receivedCnt), RATE(m_receivedDups),
+	       RATE(m_receivedUnsolicited), cur.m_averageRequestRTT);
+}
+
+static void print_budget_stats(const char *timestr, uint32_t hid, double secs,
+			       OzwBudgetStats &st)
+{
+	printf("%s\t%08x\tbudget\tqueued=%zu outstanding=%u polls=%.2f"
+	       " wait_avg=%.1fms wait_max=%.1fms interactive=%.2f"
+	       " rtt_avg=%.1fms rtt_max=%.1fms\n",
+	       timestr, hid, st.queued, st.polls_out + st.interactive_out,
+	       st.polls / secs,
+	       st.polls ? st.wait_ns / 1e6 / st.polls : 0.0,
+	       st.wait_max_ns / 1e6, st.interactive / secs,
+	       st.interactive ? st.interactive_ns / 1e6 / st.interactive : 0.0,
+	       st.interactive_max_ns / 1e6);
+}
+
+#undef RATE
+
+// Printed with the statistics, so only with -D.  Takes the shard
+// locks, so mustn't be called with out_mutex held
+static void print_memory(void)
+{
+	char timestr[128];
+	size_t nvalues = 0, pool_bytes = 0;
+	int i;
+
+	for (i = 0; i < ozw_num_shards(); i++) {
+		Shard *shard = &shards[i];
+
+		pthread_mutex_lock(&shard->mutex);
+		nvalues += shard->pool.live();
+		pool_bytes += shard->pool.bytes();
+		pthread_mutex_unlock(&shard->mutex);
+	}
+
+	pthread_mutex_lock(&out_mutex);
+	format_time(timestr, sizeof(timestr));
+	printf("%s\tpollozw\tmemory\tvalues=%zu pool=%zu rss=%zu\n",
+	       timestr, nvalues, pool_bytes, ozw_rss_bytes());
+	pthread_mutex_unlock(&out_mutex);
 }
 
 //-----------------------------------------------------------------------------
-// <OnNotification>
-// Callback that is triggered when a value, group or node changes
+// <sample_stats>
+// Read driver statistics for every controller, and node statistics
+// for every node we're polling, and print the rates of change since
+// the last sample, followed by our memory use.  Called without
+// g_mutex held.
 //-----------------------------------------------------------------------------
-void OnNotification(Notification const *n, void *ctx)
+static void sample_stats(Manager *mgr)
 {
-	Manager *mgr = Manager::Get();
-	pthread_mutex_lock(&g_mutex);
+	char timestr[128];
+	int i;
+
+	for (i = 0; i < ozw_num_shards(); i++) {
+		Shard *shard = &shards[i];
+		uint32_t hid = ozw_shard_home_id(i);
+		uint64_t now = ozw_now_ns();
+		double secs = (now - shard->stats_ns) / 1e9;
+		bool first = (shard->stats_ns == 0);
+		Driver::DriverData driver;
+		map<uint8_t, Node::NodeData> nodes;
+		OzwBudgetStats budget;
+
+		mgr->GetDriverStatistics(hid, &driver);
+		ozw_budget_sample(hid, &budget);
+
+		pthread_mutex_lock(&shard->mutex);
+		for (map<ValueID, ValueInfo *>::iterator it
+			     = shard->vidmap.begin();
+		     it != shard->vidmap.end(); it++)
+			nodes[it->first.GetNodeId()];
+		pthread_mutex_unlock(&shard->mutex);
+
+		for (map<uint8_t, Node::NodeData>::iterator it = nodes.begin();
+		     it != nodes.end(); it++)
+			mgr->GetNodeStatistics(hid, it->first, &it->second);
 
-	switch (n->GetType()) {
-	case Notification::Type_ValueRemoved:
-		vidmap.erase(n->GetValueID());
-		break;
+		if (!first) {
+			pthread_mutex_lock(&out_mutex);
+			format_time(timestr, sizeof(timestr));
 
-	case Notification::Type_ValueAdded:
-		for (list<ValueMatcher *>::iterator it = matchlist.begin();
-		     it != matchlist.end(); it++) {
-			if ((*it)->matches(n)) {
-				vidmap[n->GetValueID()] = new ValueInfo();
+			print_driver_stats(timestr, hid, secs, driver,
+					   shard->driver_stats);
+			for (map<uint8_t, Node::NodeData>::iterator it
+				     = nodes.begin();
+			     it != nodes.end(); it++) {
+				if (!shard->node_stats.count(it->first))
+					continue;
+				print_node_stats(timestr, hid, it->first, secs,
+						 it->second,
+						 shard->node_stats[it->first]);
 			}
+			if (budget_controller)
+				print_budget_stats(timestr, hid, secs, budget);
+
+			pthread_mutex_unlock(&out_mutex);
 		}
-		break;
 
-	case Notification::Type_ValueChanged:
-		if (!scanned)
-			/* only start polling once we've completed the scan */
-			break;
-		if (vidmap.count(n->GetValueID()))
-			print_value(mgr, n->GetValueID());
-		break;
+		shard->stats_ns = now;
+		shard->driver_stats = driver;
+		shard->node_stats = nodes;
+	}
 
-	case Notification::Type_Group:
-		break;
+	print_memory();
+}
 
-	case Notification::Type_NodeAdded:
-		break;
+static NotificationDispatcher dispatcher;
 
-	case Notification::Type_NodeRemoved:
-		break;
+//-----------------------------------------------------------------------------
+// Notification handlers
+// The dispatcher runs these unlocked, each takes the lock for the
+// shard the notification came from.  Notifications from a
+// controller that isn't up and running yet have no shard, and are
+// ignored.
+//-----------------------------------------------------------------------------
+static Shard *lock_shard(ZWaveEvent const *ev)
+{
+	int idx = ozw_shard(ev->hid);
 
-	case Notification::Type_NodeEvent:
-		break;
+	if (idx < 0)
+		return NULL;
 
-	case Notification::Type_PollingDisabled:
-		break;
+	ozw_lock(&shards[idx].mutex);
+	return &shards[idx];
+}
 
-	case Notification::Type_PollingEnabled:
-		break;
+// Called with the shard lock held
+static void remove_value(Shard *shard, map<ValueID, ValueInfo *>::iterator it)
+{
+	ozw_poll_on_wake(it->first, false);
+	shard->pool.put(it->second);
+	shard->vidmap.erase(it);
+}
 
-	case Notification::Type_DriverReady:
-		break;
+static void on_value_removed(ZWaveEvent const *ev)
+{
+	Shard *shard = lock_shard(ev);
+	map<ValueID, ValueInfo *>::iterator it;
 
-	case Notification::Type_DriverFailed:
-		error("Driver failed");
-		scanned = true;
-		failed = true;
-		break;
+	if (!shard)
+		return;
+	shard->known.erase(ev->vid);
+	it = shard->vidmap.find(ev->vid);
+	if (it != shard->vidmap.end())
+		remove_value(shard, it);
+	pthread_mutex_unlock(&shard->mutex);
+}
+
+// Called with the shard lock held
+static int target_column(ValueID const &vid)
+{
+	int column = 0;
+
+	for (list<ValueMatcher *>::iterator it = matchlist.begin();
+	     it != matchlist.end(); it++, column++)
+		if ((*it)->matches(vid))
+			return column;
+
+	return -1;
+}
+
+// Note a value's latest fields for the next snapshot.  Called with
+// the shard lock held.
+static void note_value(Manager *mgr, ValueID const &vid, ValueInfo *vi)
+{
+	format_fields(mgr, vid, vi, NULL, &vi->fields);
+	vi->updated_ns = ozw_now_ns();
+}
+
+// A value that's polled but never changes would otherwise show as
+// missing in every snapshot, so start from what OpenZWave has, once
+// the scan's filled that in.  Called with the shard lock held.
+static void seed_value(ValueID const &vid, ValueInfo *vi)
+{
+	if (snapshot_interval && ozw_shard_scanned(ozw_shard(vid.GetHomeId())))
+		note_value(Manager::Get(), vid, vi);
+}
+
+// Called with the shard lock held
+static void add_value(Shard *shard, ValueID const &vid, int column)
+{
+	ValueInfo *vi = shard->pool.get();
 
-	case Notification::Type_AwakeNodesQueried:
-	case Notification::Type_AllNodesQueried:
-	case Notification::Type_AllNodesQueriedSomeDead:
-		scanned = true;
-		pthread_cond_broadcast(&g_cond);
-		break;
+	vi->column = column;
+	vi->metrics = metrics[column];
+	shard->vidmap[vid] = vi;
+	seed_value(vid, vi);
+}
 
-	case Notification::Type_DriverReset:
-	case Notification::Type_Notification:
-	case Notification::Type_NodeNaming:
-	case Notification::Type_NodeProtocolInfo:
-	case Notification::Type_NodeQueriesComplete:
-	default:
-		break;
+static void on_value_added(ZWaveEvent const *ev)
+{
+	Shard *shard = lock_shard(ev);
+	int column;
+
+	if (!shard)
+		return;
+	shard->known.insert(ev->vid);
+	// A value can be added again when its node is re-queried
+	if (shard->vidmap.count(ev->vid)) {
+		pthread_mutex_unlock(&shard->mutex);
+		return;
 	}
+	column = target_column(ev->vid);
+	if (column >= 0)
+		add_value(shard, ev->vid, column);
+	pthread_mutex_unlock(&shard->mutex);
+}
 
-	pthread_mutex_unlock(&g_mutex);
+// OpenZWave doesn't always remove a node's values one by one first
+static void on_node_removed(ZWaveEvent const *ev)
+{
+	Shard *shard = lock_shard(ev);
+	map<ValueID, ValueInfo *>::iterator it;
+
+	if (!shard)
+		return;
+	it = shard->vidmap.begin();
+	while (it != shard->vidmap.end()) {
+		if (it->first.GetNodeId() == ev->nid)
+			remove_value(shard, it++);
+		else
+			it++;
+	}
+	for (set<ValueID>::iterator kt = shard->known.begin();
+	     kt != shard->known.end(); ) {
+		if (kt->GetNodeId() == ev->nid)
+			shard->known.erase(kt++);
+		else
+			kt++;
+	}
+	pthread_mutex_unlock(&shard->mutex);
+}
+
+// Called with the shard locked
+static void value_sampled(Manager *mgr, ZWaveEvent const *ev, ValueInfo *vi)
+{
+	double d;
+
+	if ((vi->metrics.mask & ~METRIC_RAW)
+	    && ozw_value_as_double(mgr, ev->vid, &d))
+		vi->derived.sample(d, ozw_now_ns(), vi->metrics.ewma_tau);
+
+	if (snapshot_interval)
+		note_value(mgr, ev->vid, vi);
+	if ((!snapshot_interval || pubsub_path)
+	    && ozw_shard_scanned(ozw_shard(ev->hid))) {
+		/* only start polling once we've completed the scan */
+		print_value(mgr, ev->vid, vi);
+	}
+}
+
+static void on_value_changed(ZWaveEvent const *ev)
+{
+	Shard *shard = lock_shard(ev);
+	map<ValueID, ValueInfo *>::iterator it;
+
+	if (!shard)
+		return;
+	it = shard->vidmap.find(ev->vid);
+	if (it != shard->vidmap.end())
+		value_sampled(Manager::Get(), ev, it->second);
+	pthread_mutex_unlock(&shard->mutex);
+}
+
+// The value's been polled, but hasn't changed.  For derived metrics
+// that's still a sample, so a meter that's stopped shows a zero rate,
+// and the integral and EWMA see the flat stretch.  Either way it's
+// fresh for snapshots.
+static void on_value_refreshed(ZWaveEvent const *ev)
+{
+	Shard *shard = lock_shard(ev);
+	map<ValueID, ValueInfo *>::iterator it;
+	ValueInfo *vi;
+
+	if (!shard)
+		return;
+	it = shard->vidmap.find(ev->vid);
+	if (it != shard->vidmap.end()) {
+		vi = it->second;
+		if (vi->metrics.mask & ~METRIC_RAW)
+			value_sampled(Manager::Get(), ev, vi);
+		else if (snapshot_interval)
+			note_value(Manager::Get(), ev->vid, vi);
+	}
+	pthread_mutex_unlock(&shard->mutex);
+}
+
+static void on_driver_failed(ZWaveEvent const *ev)
+{
+	error("Driver failed");
+}
+
+// Rules see every sample of their values, whether or not they're
+// targets.  A refresh counts, so a rule can fire on a value that's
+// stopped changing.
+static void on_rule_value_added(ZWaveEvent const *ev)
+{
+	ozw_rules_value_added(ev->vid);
+}
+
+static void on_rule_value_removed(ZWaveEvent const *ev)
+{
+	ozw_rules_value_removed(ev->vid);
+}
+
+static void on_rule_sample(ZWaveEvent const *ev)
+{
+	ozw_rules_sample(Manager::Get(), ev->vid);
+}
+
+static void register_handlers(void)
+{
+	vector<MetricSpec>::const_iterator it;
+	bool refreshes = false;
+
+	dispatcher.on(Notification::Type_ValueRemoved, on_value_removed);
+	dispatcher.on(Notification::Type_ValueAdded, on_value_added);
+	dispatcher.on(Notification::Type_ValueChanged, on_value_changed);
+	// Refreshes are samples for derived metrics, and a reloaded
+	// target file could ask for some we aren't deriving yet
+	for (it = metrics.begin(); it != metrics.end(); it++)
+		if (it->mask & ~METRIC_RAW)
+			refreshes = true;
+	if (snapshot_interval || target_file || refreshes)
+		dispatcher.on(Notification::Type_ValueRefreshed,
+			      on_value_refreshed);
+	dispatcher.on(Notification::Type_NodeRemoved, on_node_removed);
+	dispatcher.on(Notification::Type_DriverFailed, on_driver_failed);
+	if (rule_file) {
+		dispatcher.on(Notification::Type_ValueAdded,
+			      on_rule_value_added);
+		dispatcher.on(Notification::Type_ValueRemoved,
+			      on_rule_value_removed);
+		dispatcher.on(Notification::Type_ValueChanged, on_rule_sample);
+		dispatcher.on(Notification::Type_ValueRefreshed,
+			      on_rule_sample);
+	}
+	ozw_async_attach(&dispatcher);
+}
+
+static void free_matchers(list<ValueMatcher *> *ml)
+{
+	for (list<ValueMatcher *>::iterator it = ml->begin();
+	     it != ml->end(); it++)
+		delete *it;
+	ml->clear();
+}
+
+//-----------------------------------------------------------------------------
+// <make_matchers>
+// Make a matcher for each target.  A target's value id can be
+// followed by ':' and the metrics to output, e.g. "1,0x32,0:counter",
+// and by default it's just the raw value.
+//-----------------------------------------------------------------------------
+static bool make_matchers(const vector<string> &targets,
+			  list<ValueMatcher *> *ml, vector<MetricSpec> *specs)
+{
+	for (vector<string>::const_iterator it = targets.begin();
+	     it != targets.end(); it++) {
+		size_t space = it->find(' ');
+		size_t colon = it->find(':', space);
+		string vstr = it->substr(space + 1, colon - space - 1);
+		MetricSpec spec;
+		ValueMatcher *m = new ValueMatcher(it->substr(0, space), vstr);
+
+		if (colon == string::npos)
+			parse_metrics("raw", &spec);
+		if (!m->valid() || ((colon != string::npos)
+				    && !parse_metrics(it->substr(colon + 1),
+						      &spec))) {
+			fprintf(stderr, "Bad target \"%s\"\n", it->c_str());
+			delete m;
+			free_matchers(ml);
+			specs->clear();
+			return false;
+		}
+		ml->push_back(m);
+		specs->push_back(spec);
+	}
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// <read_target_file>
+// Add the targets in the target file, one
+// "<home-id>:<node-id> <instance>,<command class>,<index>" per line,
+// with blank lines and lines starting with '#' ignored
+//-----------------------------------------------------------------------------
+static bool read_target_file(vector<string> *targets)
+{
+	string text;
+	size_t pos = 0, nl;
+
+	if (!read_file(target_file, &text)) {
+		fprintf(stderr, "Couldn't read %s: %s\n", target_file,
+			strerror(errno));
+		return false;
+	}
+
+	for (; pos < text.size(); pos = nl + 1) {
+		char nstr[32], vstr[64], extra;
+		string line;
+		int n;
+
+		nl = text.find('\n', pos);
+		if (nl == string::npos)
+			nl = text.size();
+		line = text.substr(pos, nl - pos);
+
+		n = sscanf(line.c_str(), " %31s %63s %c", nstr, vstr, &extra);
+		if ((n <= 0) || (nstr[0] == '#'))
+			continue;
+		if (n != 2) {
+			fprintf(stderr, "%s: bad target \"%s\"\n", target_file,
+				line.c_str());
+			return false;
+		}
+		targets->push_back(string(nstr) + " " + vstr);
+	}
+
+	return true;
 }
 
 void usage(void)
 {
 	fprintf(stderr,
-		"pollozw [-p port] [-i interval] [-f time format] [-u]\n"
-		"        {<home-id>:<node-id> <instance>,<command class>,<index>}...\n");
+		"pollozw [-i interval] [-D stats and memory interval] [-s snapshot interval] [-f time format] [-u] [-U socket] [-t target file] [-b controller budget[,node budget]] [-r rule file [-e event file] [-B]] " OZW_COMMON_USAGE "\n"
+		"        {<home-id>:<node-id> <instance>,<command class>,<index>[:<metric>[+<metric>]...]}...\n"
+		"metrics: raw rate counter integral ewma[=<seconds>]\n");
 	exit(1);
 }
 
@@ -215,7 +716,7 @@ void parse_options(int argc, char *argv[])
 	int opt;
 	int i;
 
-	while ((opt = getopt(argc, argv, "dvp:i:f:u")) != -1) {
+	while ((opt = getopt(argc, argv, "dvi:D:s:f:uU:t:b:r:e:B" OZW_COMMON_OPTS)) != -1) {
 		switch (opt) {
 		case 'd':
 			debug++;
@@ -223,30 +724,502 @@ void parse_options(int argc, char *argv[])
 		case 'v':
 			verbose++;
 			break;
-		case 'p':
-			zwave_port = optarg;
-			break;
 		case 'i':
 			interval = strtoul(optarg, &ep, 0);
 			if (*ep)
 				usage();
 			break;
+		case 'D':
+			stats_interval = strtoul(optarg, &ep, 0);
+			if (*ep)
+				usage();
+			break;
+		case 's':
+			snapshot_interval = strtoul(optarg, &ep, 0);
+			if (*ep)
+				usage();
+			break;
 		case 'f':
 			time_fmt = optarg;
 			break;
 		case 'u':
 			use_utc = true;
 			break;
+		case 'U':
+			pubsub_path = optarg;
+			break;
+		case 't':
+			target_file = optarg;
+			break;
+		case 'r':
+			rule_file = optarg;
+			break;
+		case 'e':
+			event_file = optarg;
+			break;
+		case 'B':
+			benchmark = true;
+			break;
+		case 'b':
+			budget_controller = strtoul(optarg, &ep, 0);
+			if (*ep == ',')
+				budget_node = strtoul(ep + 1, &ep, 0);
+			if (*ep || !budget_controller || !budget_node)
+				usage();
+			break;
 		default:
-			usage();
+			if (!ozw_common_option(opt, optarg))
+				usage();
 		}
 	}
 
 	if ((argc - optind) % 2)
 		usage();
 
-	for (i = optind; i  < argc; i += 2) {
-		matchlist.push_back(new ValueMatcher(argv[i], argv[i + 1]));
+	for (i = optind; i  < argc; i += 2)
+		arg_targets.push_back(string(argv[i]) + " " + argv[i + 1]);
+
+	columns = arg_targets;
+	if (target_file && !read_target_file(&columns))
+		exit(1);
+	if (!make_matchers(columns, &matchlist, &metrics))
+		usage();
+
+	if (budget_controller)
+		ozw_budget_init(budget_controller, budget_node);
+
+	if ((event_file || benchmark) && !rule_file)
+		usage();
+	if (rule_file) {
+		FILE *sink = stdout;
+
+		if (event_file)
+			sink = fopen(event_file, "a");
+		if (!sink) {
+			fprintf(stderr, "Couldn't open %s: %s\n", event_file,
+				strerror(errno));
+			exit(1);
+		}
+		if (!ozw_rules_load(rule_file, sink))
+			exit(1);
+	}
+}
+
+//-----------------------------------------------------------------------------
+// <enable_poll>
+// Start polling a value.  Polls to a sleeping node would just sit in
+// the send queue until it wakes, so for those we instead refresh the
+// value each time the node wakes up.  With an airtime budget,
+// budget_main() polls everything else.
+//-----------------------------------------------------------------------------
+static void enable_poll(Manager *mgr, ValueID const &vid)
+{
+	uint32_t hid = vid.GetHomeId();
+	uint8_t nid = vid.GetNodeId();
+
+	if (ozw_node_sleeps(hid, nid)) {
+		pr_debug(1, "%s is a sleeping node, reading on wake-up\n",
+			 format_znode(hid, nid).c_str());
+		ozw_poll_on_wake(vid, true);
+	} else if (!budget_controller) {
+		mgr->EnablePoll(vid);
+	}
+}
+
+static void disable_poll(Manager *mgr, ValueID const &vid)
+{
+	if (ozw_node_sleeps(vid.GetHomeId(), vid.GetNodeId()))
+		ozw_poll_on_wake(vid, false);
+	else if (!budget_controller)
+		mgr->DisablePoll(vid);
+}
+
+//-----------------------------------------------------------------------------
+// <reload_targets>
+// Re-read the target file, and bring what we're polling into line
+// with it.  Values come from those we already know of, so there's no
+// need to scan the network again.  If the file's bad, we carry on
+// with the old targets.
+//-----------------------------------------------------------------------------
+static void reload_targets(Manager *mgr)
+{
+	vector<string> new_columns = arg_targets;
+	list<ValueMatcher *> new_matchlist;
+	vector<MetricSpec> new_metrics;
+	int added = 0, removed = 0;
+	int i;
+
+	if (!read_target_file(&new_columns)
+	    || !make_matchers(new_columns, &new_matchlist, &new_metrics)) {
+		fprintf(stderr, "Keeping the old targets\n");
+		return;
+	}
+
+	pthread_mutex_lock(&targets_mutex);
+	for (i = 0; i < OZW_MAX_DRIVERS; i++)
+		pthread_mutex_lock(&shards[i].mutex);
+
+	matchlist.swap(new_matchlist);
+	metrics.swap(new_metrics);
+	columns.swap(new_columns);
+	columns_changed = true;
+
+	for (i = 0; i < ozw_num_shards(); i++) {
+		Shard *shard = &shards[i];
+		map<ValueID, ValueInfo *>::iterator it;
+
+		it = shard->vidmap.begin();
+		while (it != shard->vidmap.end()) {
+			int column = target_column(it->first);
+
+			if (column >= 0) {
+				ValueID const &vid = it->first;
+				ValueInfo *vi = (it++)->second;
+
+				// Different metrics need starting afresh
+				if (vi->metrics.mask != metrics[column].mask) {
+					vi->derived = DerivedMetrics();
+					vi->updated_ns = 0;
+				}
+				vi->column = column;
+				vi->metrics = metrics[column];
+				if (!vi->updated_ns)
+					seed_value(vid, vi);
+				continue;
+			}
+			disable_poll(mgr, it->first);
+			remove_value(shard, it++);
+			removed++;
+		}
+
+		for (set<ValueID>::iterator kt = shard->known.begin();
+		     kt != shard->known.end(); kt++) {
+			int column;
+
+			if (shard->vidmap.count(*kt))
+				continue;
+			column = target_column(*kt);
+			if (column < 0)
+				continue;
+
+			add_value(shard, *kt, column);
+			// Otherwise poll_main() will get to it
+			if (ozw_all_scanned())
+				enable_poll(mgr, *kt);
+			added++;
+		}
+	}
+
+	for (i = OZW_MAX_DRIVERS - 1; i >= 0; i--)
+		pthread_mutex_unlock(&shards[i].mutex);
+	pthread_mutex_unlock(&targets_mutex);
+
+	free_matchers(&new_matchlist);
+
+	pr_debug(1, "Reloaded %s, %d values added, %d removed\n",
+		 target_file, added, removed);
+}
+
+//-----------------------------------------------------------------------------
+// <watch_targets>
+// Thread reloading the target file whenever it's rewritten.  We watch
+// the directory, since editors often replace the file rather than
+// writing to it.
+//-----------------------------------------------------------------------------
+static void *watch_targets(void *arg)
+{
+	Manager *mgr = (Manager *)arg;
+	string path = target_file;
+	size_t slash = path.rfind('/');
+	string dir = (slash == string::npos) ? "." : path.substr(0, slash + 1);
+	string name = path.substr((slash == string::npos) ? 0 : slash + 1);
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	int fd;
+
+	fd = inotify_init1(IN_CLOEXEC);
+	if ((fd < 0) || (inotify_add_watch(fd, dir.c_str(),
+					   IN_CLOSE_WRITE | IN_MOVED_TO) < 0)) {
+		error("Couldn't watch %s: %s\n", target_file, strerror(errno));
+		return NULL;
+	}
+
+	for (;;) {
+		ssize_t len = read(fd, buf, sizeof(buf));
+		bool changed = false;
+		char *p;
+
+		if (len <= 0) {
+			if ((len < 0) && (errno == EINTR))
+				continue;
+			error("Lost watch on %s\n", target_file);
+			break;
+		}
+
+		for (p = buf; p < buf + len; ) {
+			struct inotify_event *ie = (struct inotify_event *)p;
+
+			if (ie->len && (name == ie->name))
+				changed = true;
+			p += sizeof(*ie) + ie->len;
+		}
+
+		if (changed)
+			reload_targets(mgr);
+	}
+
+	close(fd);
+	return NULL;
+}
+
+//-----------------------------------------------------------------------------
+// <benchmark_main>
+// Once the rules' values are in, time the whole sample path, reading
+// each value from OpenZWave and evaluating its rules
+//-----------------------------------------------------------------------------
+static AsyncTask benchmark_main(Manager *mgr)
+{
+	size_t nvalues;
+	double ns;
+
+	if (co_await ozw_scan_complete(0, &stop) != ASYNC_OK)
+		co_return;
+
+	ns = ozw_rules_benchmark_read(mgr, BENCHMARK_READS, &nvalues);
+	if (nvalues)
+		printf("%.1f ns per sample reading values and evaluating rules, over %zu values\n",
+		       ns, nvalues);
+	else
+		printf("No rule's value was found to read\n");
+}
+
+//-----------------------------------------------------------------------------
+// <poll_main>
+// Task starting the polling once the scan is done, then sampling
+// statistics until something fails.  The values themselves are
+// printed straight from the notification handlers.
+//-----------------------------------------------------------------------------
+static AsyncTask poll_main(Manager *mgr)
+{
+	uint64_t next, now;
+	int i;
+
+	if (co_await ozw_scan_complete(0, &stop) != ASYNC_OK)
+		co_return;
+
+	pr_debug(1, "Z-Wave scan completed\n");
+
+	pr_debug(1, "Poll interval %lus\n", interval);
+	mgr->SetPollInterval(interval * 1000, false);
+
+	for (i = 0; i < OZW_MAX_DRIVERS; i++) {
+		Shard *shard = &shards[i];
+
+		pthread_mutex_lock(&shard->mutex);
+		for (map<ValueID, ValueInfo *>::iterator it
+			     = shard->vidmap.begin();
+		     it != shard->vidmap.end(); it++) {
+			enable_poll(mgr, it->first);
+		}
+		pthread_mutex_unlock(&shard->mutex);
+	}
+
+	if (!stats_interval) {
+		co_await ozw_sleep(0, &stop);
+		co_return;
+	}
+
+	sample_stats(mgr);
+	next = ozw_now_ns();
+	for (;;) {
+		// Keep to the schedule, however long sampling takes
+		next += stats_interval * 1000000000ULL;
+		now = ozw_now_ns();
+		if (co_await ozw_sleep((next > now) ? (next - now) : 1, &stop)
+		    != ASYNC_OK)
+			break;
+
+		sample_stats(mgr);
+	}
+}
+
+//-----------------------------------------------------------------------------
+// <print_header>
+// A column for each target, or for a target with several metrics, a
+// column for each metric.  Called with targets_mutex and out_mutex
+// held.
+//-----------------------------------------------------------------------------
+static void print_header(void)
+{
+	size_t i;
+
+	printf("time");
+	for (i = 0; i < columns.size(); i++) {
+		vector<string> names = metric_list(metrics[i]);
+		string base = columns[i].substr(0, columns[i].find(':',
+							columns[i].find(' ')));
+
+		if (names.size() == 1) {
+			printf("\t%s", columns[i].c_str());
+			continue;
+		}
+		for (vector<string>::iterator it = names.begin();
+		     it != names.end(); it++)
+			printf("\t%s:%s", base.c_str(), it->c_str());
+	}
+	printf("\n");
+
+	columns_changed = false;
+}
+
+//-----------------------------------------------------------------------------
+// <budget_main>
+// Task queueing a poll of every value from a listening node each
+// interval, in place of OpenZWave's polling.  Polls still waiting
+// from last time aren't queued twice.
+//-----------------------------------------------------------------------------
+static AsyncTask budget_main(void)
+{
+	uint64_t next, now;
+	int i;
+
+	if (co_await ozw_scan_complete(0, &stop) != ASYNC_OK)
+		co_return;
+
+	next = ozw_now_ns();
+	for (;;) {
+		for (i = 0; i < ozw_num_shards(); i++) {
+			Shard *shard = &shards[i];
+
+			pthread_mutex_lock(&shard->mutex);
+			for (map<ValueID, ValueInfo *>::iterator it
+				     = shard->vidmap.begin();
+			     it != shard->vidmap.end(); it++) {
+				if (!ozw_node_sleeps(it->first.GetHomeId(),
+						     it->first.GetNodeId()))
+					ozw_budget_poll(it->first);
+			}
+			pthread_mutex_unlock(&shard->mutex);
+		}
+
+		next += interval * 1000000000ULL;
+		now = ozw_now_ns();
+		if (co_await ozw_sleep((next > now) ? (next - now) : 1, &stop)
+		    != ASYNC_OK)
+			break;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// <print_snapshot>
+// Print the latest of every value as one row, in target order.
+// Stale values are marked with a '*', and those we've never heard
+// from are '-'.  If the targets have been reloaded, a new header
+// comes first.
+//-----------------------------------------------------------------------------
+static void print_snapshot(void)
+{
+	char timestr[128];
+	uint64_t now = ozw_now_ns();
+	uint64_t stale_ns = STALE_POLLS * interval * 1000000000ULL;
+	int i;
+
+	pthread_mutex_lock(&targets_mutex);
+
+	vector<vector<string> > row(columns.size());
+
+	for (i = 0; i < ozw_num_shards(); i++) {
+		Shard *shard = &shards[i];
+
+		pthread_mutex_lock(&shard->mutex);
+		for (map<ValueID, ValueInfo *>::iterator it
+			     = shard->vidmap.begin();
+		     it != shard->vidmap.end(); it++) {
+			ValueInfo *vi = it->second;
+
+			if (!vi->updated_ns)
+				continue;
+
+			row[vi->column] = vi->fields;
+			if ((now - vi->updated_ns) <= stale_ns)
+				continue;
+			for (vector<string>::iterator ft
+				     = row[vi->column].begin();
+			     ft != row[vi->column].end(); ft++)
+				*ft += "*";
+		}
+		pthread_mutex_unlock(&shard->mutex);
+	}
+
+	for (i = 0; i < (int)row.size(); i++)
+		if (row[i].empty())
+			row[i].resize(metric_list(metrics[i]).size(), "-");
+
+	pthread_mutex_lock(&out_mutex);
+	if (columns_changed)
+		print_header();
+	format_time(timestr, sizeof(timestr));
+	printf("%s", timestr);
+	for (i = 0; i < (int)row.size(); i++)
+		printf("\t%s", join(row[i]).c_str());
+	printf("\n");
+	pthread_mutex_unlock(&out_mutex);
+
+	pthread_mutex_unlock(&targets_mutex);
+}
+
+// Seed everything added before the scan finished.  Called with
+// targets_mutex held.
+static void seed_values(void)
+{
+	int i;
+
+	for (i = 0; i < ozw_num_shards(); i++) {
+		Shard *shard = &shards[i];
+
+		pthread_mutex_lock(&shard->mutex);
+		for (map<ValueID, ValueInfo *>::iterator it
+			     = shard->vidmap.begin();
+		     it != shard->vidmap.end(); it++)
+			if (!it->second->updated_ns)
+				seed_value(it->first, it->second);
+		pthread_mutex_unlock(&shard->mutex);
+	}
+}
+
+//-----------------------------------------------------------------------------
+// <snapshot_main>
+// Task printing a snapshot row every snapshot_interval seconds, on
+// multiples of the interval by the wall clock, so rows from separate
+// runs line up
+//-----------------------------------------------------------------------------
+static AsyncTask snapshot_main(void)
+{
+	uint64_t period = snapshot_interval * 1000000000ULL;
+	uint64_t wall, next, now;
+	struct timespec ts;
+
+	if (co_await ozw_scan_complete(0, &stop) != ASYNC_OK)
+		co_return;
+
+	pthread_mutex_lock(&targets_mutex);
+	seed_values();
+	pthread_mutex_lock(&out_mutex);
+	print_header();
+	pthread_mutex_unlock(&out_mutex);
+	pthread_mutex_unlock(&targets_mutex);
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	wall = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	next = ozw_now_ns() + (period - (wall % period));
+
+	for (;;) {
+		now = ozw_now_ns();
+		if (co_await ozw_sleep((next > now) ? (next - now) : 1, &stop)
+		    != ASYNC_OK)
+			break;
+
+		print_snapshot();
+		next += period;
 	}
 }
 
@@ -258,41 +1231,59 @@ int main(int argc, char *argv[])
 {
 	Manager *mgr;
 	pthread_mutexattr_t mutexattr;
+	int i;
 
 	pthread_mutexattr_init(&mutexattr);
 	pthread_mutexattr_settype(&mutexattr, PTHREAD_MUTEX_RECURSIVE);
 	pthread_mutex_init(&g_mutex, &mutexattr);
 	pthread_mutexattr_destroy(&mutexattr);
 
+	for (i = 0; i < OZW_MAX_DRIVERS; i++)
+		pthread_mutex_init(&shards[i].mutex, NULL);
+
 	parse_options(argc, argv);
 
-	mgr = ozw_setup(zwave_port, OnNotification);
+	if (benchmark)
+		printf("%.1f ns per sample evaluating rules alone\n",
+		       ozw_rules_benchmark(BENCHMARK_SAMPLES));
 
-	pr_debug(1, "Scanning Z-Wave network\n");
+	register_handlers();
 
-	pthread_mutex_lock(&g_mutex);
-	while (!scanned) {
-		pthread_cond_wait(&g_cond, &g_mutex);
+	// Before the pubsub thread, so it inherits the blocked SIGUSR1
+	ozw_stats_init();
+
+	if (pubsub_path && !ozw_pubsub_start(pubsub_path)) {
+		fprintf(stderr, "Couldn't listen on %s: %s\n", pubsub_path,
+			strerror(errno));
+		exit(1);
 	}
 
-	if (!failed) {
-		pr_debug(1, "Z-Wave scan completed\n");
+	mgr = ozw_setup(NotificationDispatcher::dispatch, &dispatcher);
 
-		pr_debug(1, "Poll interval %lus\n", interval);
-		mgr->SetPollInterval(interval * 1000, false);
+	if (target_file) {
+		pthread_t watcher;
 
-		for (map<ValueID, ValueInfo *>::iterator it = vidmap.begin();
-		     it != vidmap.end(); it++) {
-			mgr->EnablePoll(it->first);
-		}
+		pthread_create(&watcher, NULL, watch_targets, mgr);
+		pthread_detach(watcher);
+	}
 
-		while (!failed) {
-			pthread_cond_wait(&g_cond, &g_mutex);
-		}
+	pr_debug(1, "Scanning Z-Wave network\n");
+
+	if (benchmark) {
+		ozw_async_spawn(benchmark_main(mgr));
+		ozw_async_run();
+		ozw_cleanup(mgr);
+		exit(failed ? 1 : 0);
 	}
 
-	pthread_mutex_unlock(&g_mutex);
+	ozw_async_spawn(poll_main(mgr));
+	if (budget_controller)
+		ozw_async_spawn(budget_main());
+	if (snapshot_interval)
+		ozw_async_spawn(snapshot_main());
+	ozw_async_run();
 
+	ozw_pubsub_stop();
 	ozw_cleanup(mgr);
 
 	pthread_mutex_destroy(&g_mutex);
@@ -0,0 +1,546 @@
+//
+// probeozw - Tool to measure Z-Wave node latency and reliability
+//
+// Copyright David Gibson 2015 <ozw@gibson.dropbear.id.au>
+//
+// Based on the MinOZW code shipped with OpenZWave:
+//     Copyright (c) 2010 Mal Lansell <mal@openzwave.com>
+//
+// This program is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see
+// <http://www.gnu.org/licenses/>.
+//
+// Each probe is a single NoOperation frame sent with TestNetworkNode(),
+// timed from the request to the matching NoOperation (or Timeout)
+// notification.  Only one probe is outstanding at a time, and probes
+// are paced at a fixed rate so we don't flood the network we're
+// trying to measure.
+//
+// The notifications don't say which probe they answer, but OpenZWave
+// reports exactly one result for each, in order, so we number the
+// probes to each node and count off the results.  One that turns up
+// after we've given up on its probe is thrown away, rather than
+// credited to the next.
+//
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <time.h>
+#include <algorithm>
+
+#include "ozw_tools.h"
+
+#define DEFAULT_COUNT		10
+#define DEFAULT_RATE		2.0
+#define DEFAULT_TIMEOUT		5
+
+using namespace OpenZWave;
+
+// Global configuration
+static int verbose = 0;
+static int debug = 0;
+static unsigned long probe_count = DEFAULT_COUNT;
+static double rate = DEFAULT_RATE;
+static unsigned long timeout = DEFAULT_TIMEOUT;
+static unsigned long simulate = 0;
+static list<string> nodes_to_probe;
+
+// Global state
+static pthread_mutex_t g_mutex;
+static pthread_cond_t g_cond = PTHREAD_COND_INITIALIZER;
+
+static bool scanned = false;
+static bool failed = false;
+
+class ProbeInfo {
+public:
+	uint32_t hid;
+	uint8_t nid;
+	unsigned long sent;	// also the number of the latest probe
+	unsigned long results;	// results seen, for probes 1..results
+	unsigned long lost;
+	vector<double> rtts;	// in ms
+	Node::NodeData before;
+	Node::NodeData after;
+};
+
+static vector<ProbeInfo *> probes;
+static list<ProbeInfo *> scanned_nodes;
+
+// The probe currently awaiting a response
+static ProbeInfo *outstanding;
+static bool answered;
+static bool answer_ok;
+
+static void pr_debug(int level, const char *fmt, ...)
+	__attribute__((format (printf, 2, 3)));
+
+static void pr_debug(int level, const char *fmt, ...)
+{
+	va_list ap;
+
+	if (debug < level)
+		return;
+
+	pthread_mutex_lock(&g_mutex);
+
+	va_start(ap, fmt);
+	fprintf(stderr, "DEBUG: ");
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+
+	pthread_mutex_unlock(&g_mutex);
+}
+
+static void error(const char *fmt, ...)
+	__attribute__((format (printf, 1, 2)));
+
+static void error(const char *fmt, ...)
+{
+	va_list ap;
+
+	pthread_mutex_lock(&g_mutex);
+
+	va_start(ap, fmt);
+	fprintf(stderr, "ERROR: ");
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+
+	failed = true;
+	pthread_cond_broadcast(&g_cond);
+
+	pthread_mutex_unlock(&g_mutex);
+}
+
+static ProbeInfo *find_probe(uint32_t hid, uint8_t nid)
+{
+	for (vector<ProbeInfo *>::iterator it = probes.begin();
+	     it != probes.end(); it++)
+		if (((*it)->hid == hid) && ((*it)->nid == nid))
+			return *it;
+
+	return NULL;
+}
+
+//-----------------------------------------------------------------------------
+// <probe_result>
+// Work out which probe a response (or failure) is for, and record it
+// if that's the one outstanding.  A dead node won't answer any probe
+// still in flight, so that accounts for all of them.  Called with
+// g_mutex held.
+//-----------------------------------------------------------------------------
+static void probe_result(uint32_t hid, uint8_t nid, bool ok, bool dead)
+{
+	ProbeInfo *pi = find_probe(hid, nid);
+	unsigned long seq;
+
+	// Not from a probe of ours
+	if (!pi || (pi->results >= pi->sent))
+		return;
+
+	seq = dead ? pi->sent : ++pi->results;
+	if (dead)
+		pi->results = pi->sent;
+
+	if ((pi != outstanding) || answered || (seq != pi->sent)) {
+		pr_debug(2, "%s: discarding late result for probe %lu\n",
+			 format_znode(hid, nid).c_str(), seq);
+		return;
+	}
+
+	answered = true;
+	answer_ok = ok;
+	pthread_cond_broadcast(&g_cond);
+}
+
+static NotificationDispatcher dispatcher(&g_mutex);
+
+//-----------------------------------------------------------------------------
+// Notification handlers, all called with g_mutex held
+//-----------------------------------------------------------------------------
+static void on_node_added(ZWaveEvent const *ev)
+{
+	ProbeInfo *pi = new ProbeInfo();
+
+	pi->hid = ev->hid;
+	pi->nid = ev->nid;
+	scanned_nodes.push_back(pi);
+}
+
+static void on_notification(ZWaveEvent const *ev)
+{
+	switch (ev->code) {
+	case Notification::Code_NoOperation:
+		probe_result(ev->hid, ev->nid, true, false);
+		break;
+	case Notification::Code_Timeout:
+		probe_result(ev->hid, ev->nid, false, false);
+		break;
+	case Notification::Code_Dead:
+		probe_result(ev->hid, ev->nid, false, true);
+		break;
+	default:
+		break;
+	}
+}
+
+static void on_driver_failed(ZWaveEvent const *ev)
+{
+	error("Driver failed");
+}
+
+static void on_scanned(ZWaveEvent const *ev)
+{
+	scanned = true;
+	pthread_cond_broadcast(&g_cond);
+}
+
+static void register_handlers(void)
+{
+	dispatcher.on(Notification::Type_NodeAdded, on_node_added);
+	dispatcher.on(Notification::Type_Notification, on_notification);
+	dispatcher.on(Notification::Type_DriverFailed, on_driver_failed);
+	dispatcher.on_scanned(on_scanned);
+}
+
+// Deliver a made up notification, the way the dispatcher would
+static void sim_notify(ProbeInfo *pi, uint8_t code)
+{
+	ZWaveEvent ev = { Notification::Type_Notification, pi->hid, pi->nid,
+			  ValueID(pi->hid, (uint64)0), code, NULL };
+
+	pthread_mutex_lock(&g_mutex);
+	on_notification(&ev);
+	pthread_mutex_unlock(&g_mutex);
+}
+
+//-----------------------------------------------------------------------------
+// <sim_respond>
+// Simulated controller: answer a probe after a plausible delay, which
+// grows with the node id, occasionally with a timeout, and
+// occasionally only after we've given up on it
+//-----------------------------------------------------------------------------
+static void *sim_respond(void *arg)
+{
+	ProbeInfo *pi = (ProbeInfo *)arg;
+	static unsigned int seed = 1;
+	unsigned int r;
+	long delay_us;
+
+	pthread_mutex_lock(&g_mutex);
+	r = rand_r(&seed);
+	pthread_mutex_unlock(&g_mutex);
+
+	delay_us = 20000 + pi->nid * 5000 + (r % 20000);
+	if ((r % 50) == 0) {
+		usleep(timeout * 1000000 / 2);
+		sim_notify(pi, Notification::Code_Timeout);
+		return NULL;
+	}
+	if ((r % 50) == 1)
+		delay_us += timeout * 1000000;
+
+	usleep(delay_us);
+	sim_notify(pi, Notification::Code_NoOperation);
+	return NULL;
+}
+
+static void send_probe(Manager *mgr, ProbeInfo *pi)
+{
+	pthread_t thread;
+
+	if (simulate) {
+		pthread_create(&thread, NULL, sim_respond, pi);
+		pthread_detach(thread);
+	} else {
+		mgr->TestNetworkNode(pi->hid, pi->nid, 1);
+	}
+}
+
+static void get_stats(Manager *mgr, ProbeInfo *pi, Node::NodeData *data)
+{
+	if (!simulate)
+		mgr->GetNodeStatistics(pi->hid, pi->nid, data);
+}
+
+void usage(void)
+{
+	fprintf(stderr,
+		"probeozw [-c count] [-r rate] [-t timeout] [-S nodes] "
+		OZW_COMMON_USAGE "\n"
+		"        [<home-id>:<node-id>]...\n");
+	exit(1);
+}
+
+void parse_options(int argc, char *argv[])
+{
+	char *ep;
+	int opt;
+	int i;
+
+	while ((opt = getopt(argc, argv, "dvc:r:t:S:" OZW_COMMON_OPTS)) != -1) {
+		switch (opt) {
+		case 'd':
+			debug++;
+			break;
+		case 'v':
+			verbose++;
+			break;
+		case 'c':
+			probe_count = strtoul(optarg, &ep, 0);
+			if (*ep)
+				usage();
+			break;
+		case 'r':
+			rate = strtod(optarg, &ep);
+			if (*ep || (rate <= 0))
+				usage();
+			break;
+		case 't':
+			timeout = strtoul(optarg, &ep, 0);
+			if (*ep)
+				usage();
+			break;
+		case 'S':
+			simulate = strtoul(optarg, &ep, 0);
+			if (*ep || (simulate > 231))
+				usage();
+			break;
+		default:
+			if (!ozw_common_option(opt, optarg))
+				usage();
+		}
+	}
+
+	for (i = optind; i < argc; i++) {
+		if (!parse_znode(argv[i], NULL, NULL))
+			usage();
+		nodes_to_probe.push_back(argv[i]);
+	}
+}
+
+//-----------------------------------------------------------------------------
+// <select_nodes>
+// Pick the nodes to probe: those asked for, or by default every
+// listening node other than the controller itself
+//-----------------------------------------------------------------------------
+static void select_nodes(Manager *mgr)
+{
+	for (list<ProbeInfo *>::iterator it = scanned_nodes.begin();
+	     it != scanned_nodes.end(); it++) {
+		ProbeInfo *pi = *it;
+		string znode = format_znode(pi->hid, pi->nid);
+
+		if (nodes_to_probe.empty()) {
+			if (mgr && (mgr->GetControllerNodeId(pi->hid)
+				    == pi->nid))
+				continue;
+			if (ozw_node_sleeps(pi->hid, pi->nid)) {
+				pr_debug(1, "Skipping sleeping node %s\n",
+					 znode.c_str());
+				continue;
+			}
+		} else if (find(nodes_to_probe.begin(), nodes_to_probe.end(),
+				znode) == nodes_to_probe.end()) {
+			continue;
+		}
+
+		probes.push_back(pi);
+	}
+}
+
+//-----------------------------------------------------------------------------
+// <probe_one>
+// Send one probe and wait for its result.  Called with g_mutex held.
+//-----------------------------------------------------------------------------
+static void probe_one(Manager *mgr, ProbeInfo *pi)
+{
+	struct timespec deadline;
+	uint64_t start;
+
+	outstanding = pi;
+	answered = false;
+	pi->sent++;
+
+	start = ozw_now_ns();
+	send_probe(mgr, pi);
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += timeout;
+
+	while (!answered && !failed) {
+		if (pthread_cond_timedwait(&g_cond, &g_mutex, &deadline)
+		    == ETIMEDOUT)
+			break;
+	}
+
+	if (answered && answer_ok) {
+		double ms = (ozw_now_ns() - start) / 1000000.0;
+
+		pi->rtts.push_back(ms);
+		pr_debug(2, "%s: %.1fms\n",
+			 format_znode(pi->hid, pi->nid).c_str(), ms);
+	} else {
+		pi->lost++;
+		pr_debug(2, "%s: lost\n",
+			 format_znode(pi->hid, pi->nid).c_str());
+	}
+
+	outstanding = NULL;
+}
+
+static double percentile(const vector<double> &sorted, double p)
+{
+	size_t rank;
+
+	if (sorted.empty())
+		return 0;
+
+	// Nearest rank
+	rank = (size_t)(p / 100.0 * sorted.size() + 0.999999);
+	if (rank < 1)
+		rank = 1;
+	if (rank > sorted.size())
+		rank = sorted.size();
+
+	return sorted[rank - 1];
+}
+
+static void report(void)
+{
+	printf("%-12s %5s %5s %8s %8s %8s %8s %7s %7s\n",
+	       "node", "sent", "lost", "p50 ms", "p90 ms", "p99 ms",
+	       "max ms", "retries", "failed");
+
+	for (vector<ProbeInfo *>::iterator it = probes.begin();
+	     it != probes.end(); it++) {
+		ProbeInfo *pi = *it;
+		vector<double> sorted = pi->rtts;
+
+		sort(sorted.begin(), sorted.end());
+
+		printf("%-12s %5lu %5lu %8.1f %8.1f %8.1f %8.1f %7u %7u\n",
+		       format_znode(pi->hid, pi->nid).c_str(),
+		       pi->sent, pi->lost,
+		       percentile(sorted, 50), percentile(sorted, 90),
+		       percentile(sorted, 99),
+		       sorted.empty() ? 0.0 : sorted.back(),
+		       pi->after.m_retries - pi->before.m_retries,
+		       pi->after.m_sentFailed - pi->before.m_sentFailed);
+
+		if (verbose && !simulate)
+			printf("\tOpenZWave: average RTT %ums request, %ums response\n",
+			       pi->after.m_averageRequestRTT,
+			       pi->after.m_averageResponseRTT);
+	}
+}
+
+//-----------------------------------------------------------------------------
+// <main>
+// Create the driver and then wait
+//-----------------------------------------------------------------------------
+int main(int argc, char *argv[])
+{
+	Manager *mgr = NULL;
+	pthread_mutexattr_t mutexattr;
+	struct timespec next, now;
+	uint64_t period_ns;
+	unsigned long i;
+
+	pthread_mutexattr_init(&mutexattr);
+	pthread_mutexattr_settype(&mutexattr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&g_mutex, &mutexattr);
+	pthread_mutexattr_destroy(&mutexattr);
+
+	parse_options(argc, argv);
+
+	if (simulate) {
+		for (i = 0; i < simulate; i++) {
+			ProbeInfo *pi = new ProbeInfo();
+
+			pi->nid = i + 2;
+			scanned_nodes.push_back(pi);
+		}
+		scanned = true;
+	} else {
+		register_handlers();
+		mgr = ozw_setup(NotificationDispatcher::dispatch, &dispatcher);
+		pr_debug(1, "Scanning Z-Wave network\n");
+	}
+
+	pthread_mutex_lock(&g_mutex);
+	while (!scanned && !failed) {
+		pthread_cond_wait(&g_cond, &g_mutex);
+	}
+
+	if (!failed) {
+		pr_debug(1, "Z-Wave scan completed\n");
+
+		select_nodes(mgr);
+		if (probes.empty())
+			fprintf(stderr, "No nodes to probe\n");
+
+		for (vector<ProbeInfo *>::iterator it = probes.begin();
+		     it != probes.end(); it++)
+			get_stats(mgr, *it, &(*it)->before);
+
+		period_ns = (uint64_t)(1000000000.0 / rate);
+		clock_gettime(CLOCK_MONOTONIC, &next);
+
+		for (i = 0; (i < probe_count) && !failed; i++) {
+			for (vector<ProbeInfo *>::iterator it = probes.begin();
+			     (it != probes.end()) && !failed; it++) {
+				probe_one(mgr, *it);
+
+				// Pace the probes, without holding the lock
+				next.tv_nsec += period_ns;
+				next.tv_sec += next.tv_nsec / 1000000000;
+				next.tv_nsec %= 1000000000;
+
+				// If a probe overran, start afresh from now,
+				// rather than bursting to catch up
+				clock_gettime(CLOCK_MONOTONIC, &now);
+				if ((next.tv_sec < now.tv_sec)
+				    || ((next.tv_sec == now.tv_sec)
+					&& (next.tv_nsec < now.tv_nsec)))
+					next = now;
+
+				pthread_mutex_unlock(&g_mutex);
+				clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+						&next, NULL);
+				pthread_mutex_lock(&g_mutex);
+			}
+		}
+
+		for (vector<ProbeInfo *>::iterator it = probes.begin();
+		     it != probes.end(); it++)
+			get_stats(mgr, *it, &(*it)->after);
+
+		report();
+	}
+
+	pthread_mutex_unlock(&g_mutex);
+
+	if (mgr)
+		ozw_cleanup(mgr);
+
+	pthread_mutex_destroy(&g_mutex);
+
+	if (failed)
+		exit(1);
+
+	exit(0);
+}
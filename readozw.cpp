@@ -30,24 +30,32 @@
 
 #define COMMAND_CLASS_METER	0x32
 
+// How long to wait for a listening node to answer a refresh
+#define REFRESH_TIMEOUT		5
+
 using namespace OpenZWave;
 
 // Global configuration
-static string zwave_port = OZW_DEFAULT_DEV;
 static int verbose = 0;
 static int debug = 0;
-static ValueMatcher *read_matcher;
+static unsigned long wake_timeout = 0;
+
+struct ReadInfo {
+	ValueMatcher *matcher;
+	bool ok;
+	string label;
+	string units;
+	string value;
+};
+
+// In the order given on the command line
+static vector<ReadInfo *> reads;
 
 // Global state
 static pthread_mutex_t g_mutex;
-static pthread_cond_t g_cond = PTHREAD_COND_INITIALIZER;
 
-static bool scanned = false;
-static bool finished = false;
 static bool failed = false;
 
-static ValueID *read_vid;
-
 static void pr_debug(int level, const char *fmt, ...)
 	__attribute__((format (printf, 2, 3)));
 
@@ -82,94 +90,32 @@ static void error(const char *fmt, ...)
 	vfprintf(stderr, fmt, ap);
 	va_end(ap);
 
-	finished = true;
 	failed = true;
-	pthread_cond_broadcast(&g_cond);
 
 	pthread_mutex_unlock(&g_mutex);
 }
 
-//-----------------------------------------------------------------------------
-// <OnNotification>
-// Callback that is triggered when a value, group or node changes
-//-----------------------------------------------------------------------------
-void OnNotification(Notification const *n, void *ctx)
-{
-	pthread_mutex_lock(&g_mutex);
-
-	switch (n->GetType()) {
-	case Notification::Type_ValueRemoved:
-		if (read_vid && (n->GetValueID() == *read_vid)) {
-			error("Value removed");
-			return;
-		}
-		break;
-
-	case Notification::Type_ValueAdded:
-		if (read_matcher->matches(n)) {
-			pr_debug(1, "ValueID 0x%llx\n", n->GetValueID().GetId());
-			read_vid = new ValueID(n->GetValueID());
-		}
-		break;
-
-	case Notification::Type_ValueChanged:
-		break;
-
-	case Notification::Type_Group:
-		break;
-
-	case Notification::Type_NodeAdded:
-		break;
-
-	case Notification::Type_NodeRemoved:
-		break;
-
-	case Notification::Type_NodeEvent:
-		break;
-
-	case Notification::Type_PollingDisabled:
-		break;
-
-	case Notification::Type_PollingEnabled:
-		break;
-
-	case Notification::Type_DriverReady:
-		break;
-
-	case Notification::Type_DriverFailed:
-		error("Driver failed");
-		break;
-
-	case Notification::Type_AwakeNodesQueried:
-	case Notification::Type_AllNodesQueried:
-	case Notification::Type_AllNodesQueriedSomeDead:
-		scanned = true;
-		pthread_cond_broadcast(&g_cond);
-		break;
-
-	case Notification::Type_DriverReset:
-	case Notification::Type_Notification:
-	case Notification::Type_NodeNaming:
-	case Notification::Type_NodeProtocolInfo:
-	case Notification::Type_NodeQueriesComplete:
-	default:
-		break;
-	}
+static NotificationDispatcher dispatcher;
 
-	pthread_mutex_unlock(&g_mutex);
+static void on_driver_failed(ZWaveEvent const *ev)
+{
+	error("Driver failed\n");
 }
 
 void usage(void)
 {
-	fprintf(stderr, "readozw [-p port] <home-id>:<node-id> <instance>,<command class>,<index>\n");
+	fprintf(stderr,
+		"readozw [-W wake timeout] " OZW_COMMON_USAGE "\n"
+		"        {<home-id>:<node-id> <instance>,<command class>,<index>}...\n");
 	exit(1);
 }
 
 void parse_options(int argc, char *argv[])
 {
+	char *ep;
 	int opt;
 
-	while ((opt = getopt(argc, argv, "dvp:")) != -1) {
+	while ((opt = getopt(argc, argv, "dvW:" OZW_COMMON_OPTS)) != -1) {
 		switch (opt) {
 		case 'd':
 			debug++;
@@ -177,40 +123,98 @@ void parse_options(int argc, char *argv[])
 		case 'v':
 			verbose++;
 			break;
-		case 'p':
-			zwave_port = optarg;
+		case 'W':
+			wake_timeout = strtoul(optarg, &ep, 0);
+			if (*ep)
+				usage();
 			break;
 		default:
-			usage();
+			if (!ozw_common_option(opt, optarg))
+				usage();
 		}
 	}
 
-	if (argc != optind + 2)
+	if ((argc == optind) || ((argc - optind) % 2))
 		usage();
 
-	read_matcher = new ValueMatcher(argv[optind], argv[optind + 1]);
-	if (!read_matcher->valid())
-		usage();	
+	for (; optind < argc; optind += 2) {
+		ReadInfo *ri = new ReadInfo();
+
+		ri->matcher = new ValueMatcher(argv[optind], argv[optind + 1]);
+		if (!ri->matcher->valid())
+			usage();
+		reads.push_back(ri);
+	}
 }
 
-static void read_value(Manager *mgr)
+//-----------------------------------------------------------------------------
+// <read_one>
+// Task reading one value.  If it belongs to a sleeping node, what we
+// have is from its last wake-up, so queue a refresh for when it next
+// wakes, and wait a while for that.  On a warm start, what we have
+// is from the cache, so refresh it, which costs one round trip.
+//-----------------------------------------------------------------------------
+static AsyncTask read_one(Manager *mgr, ReadInfo *ri)
 {
-	assert(read_vid);
-	ValueID vid = ValueID(*read_vid);
-	string label = mgr->GetValueLabel(vid);
-	string units = mgr->GetValueUnits(vid);
-	string value;
+	ValueID vid(0, (uint64)0);
+	AsyncStatus status;
+	unsigned long timeout = 0;
+	bool asleep;
+	uint64_t seq;
+
+	status = co_await ozw_value_added(ri->matcher, &vid);
+	if (status == ASYNC_FAILED)
+		co_return;
+	if (status != ASYNC_OK) {
+		error("Couldn't find value to read\n");
+		co_return;
+	}
+	pr_debug(1, "ValueID 0x%llx\n", vid.GetId());
+
+	// We don't know whether the node sleeps until it's been queried,
+	// or on a warm start, until its cached config is loaded
+	if (wake_timeout || ozw_warm_start()) {
+		status = co_await ozw_scan_complete();
+		if (status != ASYNC_OK)
+			co_return;
+	}
 
-	if (!mgr->GetValueAsString(vid, &value)) {
-		error("Unable to read value");
-		return;
+	asleep = ozw_node_sleeps(vid.GetHomeId(), vid.GetNodeId())
+		&& !ozw_node_awake(vid.GetHomeId(), vid.GetNodeId());
+
+	if (asleep && wake_timeout) {
+		pr_debug(1, "Node is asleep, waiting up to %lus for it to wake\n",
+			 wake_timeout);
+		timeout = wake_timeout;
+	} else if (!asleep && ozw_warm_start()) {
+		// What we have came from the cache, so could be old
+		pr_debug(1, "Refreshing cached value\n");
+		timeout = REFRESH_TIMEOUT;
+	}
+
+	if (timeout) {
+		seq = ozw_value_seq(vid);
+		ozw_refresh_value(mgr, vid);
+		status = co_await ozw_value_changed(vid, &seq,
+						    timeout * 1000000000ULL);
+		if (status == ASYNC_FAILED)
+			co_return;
+		if (status == ASYNC_REMOVED) {
+			error("Value removed\n");
+			co_return;
+		}
+		if (status != ASYNC_OK)
+			fprintf(stderr, "Node didn't %s, using cached value\n",
+				asleep ? "wake" : "answer");
 	}
 
-	if (verbose)
-		printf("%s\t%s %s\n", label.c_str(), value.c_str(),
-		       units.c_str());
-	else
-		printf("%s\n", value.c_str());
+	ri->label = mgr->GetValueLabel(vid);
+	ri->units = mgr->GetValueUnits(vid);
+	if (!mgr->GetValueAsString(vid, &ri->value)) {
+		error("Unable to read value\n");
+		co_return;
+	}
+	ri->ok = true;
 }
 
 //-----------------------------------------------------------------------------
@@ -229,27 +233,39 @@ int main(int argc, char *argv[])
 
 	parse_options(argc, argv);
 
-	mgr = ozw_setup(zwave_port, OnNotification);
+	dispatcher.on(Notification::Type_DriverFailed, on_driver_failed);
+	ozw_async_attach(&dispatcher);
+
+	mgr = ozw_setup(NotificationDispatcher::dispatch, &dispatcher);
 
 	pr_debug(1, "Scanning Z-Wave network\n");
 
-	pthread_mutex_lock(&g_mutex);
-	while (!scanned && !read_vid) {
-		pthread_cond_wait(&g_cond, &g_mutex);
-	}
+	// All the reads go on together, each with its own wake timeout
+	for (vector<ReadInfo *>::iterator it = reads.begin();
+	     it != reads.end(); it++)
+		ozw_async_spawn(read_one(mgr, *it));
+	ozw_async_run();
 
-	if (scanned)
-		pr_debug(1, "Z-Wave scan completed\n");
+	for (vector<ReadInfo *>::iterator it = reads.begin();
+	     it != reads.end(); it++) {
+		ReadInfo *ri = *it;
 
-	if (!read_vid) {
-		fprintf(stderr, "Couldn't find value to read\n");
-		finished = true;
-		failed = true;
-	}
+		if (!ri->ok)
+			continue;
 
-	read_value(mgr);
+		if (verbose)
+			printf("%s\t%s %s\n", ri->label.c_str(),
+			       ri->value.c_str(), ri->units.c_str());
+		else
+			printf("%s\n", ri->value.c_str());
+	}
 
-	pthread_mutex_unlock(&g_mutex);
+	for (vector<ReadInfo *>::iterator it = reads.begin();
+	     it != reads.end(); it++) {
+		delete (*it)->matcher;
+		delete *it;
+	}
+	reads.clear();
 
 	ozw_cleanup(mgr);
 
@@ -0,0 +1,538 @@
+//
+// writeozw
+//
+// Copyright David Gibson 2015 <ozw@gibson.dropbear.id.au>
+//
+// Based on the MinOZW code shipped with OpenZWave:
+//     Copyright (c) 2010 Mal Lansell <mal@openzwave.com>
+//
+// This program is free software: you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see
+// <http://www.gnu.org/licenses/>.
+//
+// Writes are taken from the command line, or streamed on stdin one
+// "<home-id>:<node-id> <instance>,<command class>,<index> <value>"
+// per line.  Only the latest requested value for each Z-Wave value is
+// ever sent: anything superseded while an earlier write is still
+// awaiting confirmation is simply dropped.  Writes are sent a node at
+// a time, and each is confirmed by the value's next report.
+//
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <time.h>
+
+#include "ozw_tools.h"
+
+#define DEFAULT_TIMEOUT		5
+
+using namespace OpenZWave;
+
+// Global configuration
+static int verbose = 0;
+static int debug = 0;
+static unsigned long timeout = DEFAULT_TIMEOUT;
+
+// Global state
+static pthread_mutex_t g_mutex;
+static pthread_cond_t g_cond = PTHREAD_COND_INITIALIZER;
+
+static bool scanned = false;
+static bool input_done = false;
+static bool failed = false;
+static int write_errors = 0;
+
+class WriteInfo {
+public:
+	ValueMatcher *matcher;
+	bool resolved;
+	ValueID vid;
+	bool pending;		// have a value waiting to be sent
+	string value;
+	bool in_flight;		// sent, awaiting confirmation
+	string sent;
+	uint64_t sent_ns;
+
+	// ValueID has no public default constructor
+	WriteInfo() : matcher(NULL), resolved(false), vid(0, (uint64)0),
+		      pending(false), in_flight(false), sent_ns(0) {}
+};
+
+// Keyed by "<home-id>:<node-id> <instance>,<ccid>,<index>" in fixed
+// width hex, so all the writes to one node are adjacent
+static map<string, WriteInfo *> writes;
+
+// Every value we know of, so writes arriving after the scan can
+// still be resolved
+static list<ValueID> known_values;
+
+static void pr_debug(int level, const char *fmt, ...)
+	__attribute__((format (printf, 2, 3)));
+
+static void pr_debug(int level, const char *fmt, ...)
+{
+	va_list ap;
+
+	if (debug < level)
+		return;
+
+	pthread_mutex_lock(&g_mutex);
+
+	va_start(ap, fmt);
+	fprintf(stderr, "DEBUG: ");
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+
+	pthread_mutex_unlock(&g_mutex);
+}
+
+static void error(const char *fmt, ...)
+	__attribute__((format (printf, 1, 2)));
+
+static void error(const char *fmt, ...)
+{
+	va_list ap;
+
+	pthread_mutex_lock(&g_mutex);
+
+	va_start(ap, fmt);
+	fprintf(stderr, "ERROR: ");
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+
+	failed = true;
+	pthread_cond_broadcast(&g_cond);
+
+	pthread_mutex_unlock(&g_mutex);
+}
+
+static string write_key(uint32_t hid, uint8_t nid,
+			uint8_t instance, uint8_t ccid, uint8_t index)
+{
+	return format_znode(hid, nid)
+		+ stringf(" %02x,%02x,%02x", instance, ccid, index);
+}
+
+static string node_of(const string &key)
+{
+	return key.substr(0, key.find(' '));
+}
+
+// Called with g_mutex held
+static void resolve(WriteInfo *wi)
+{
+	for (list<ValueID>::iterator it = known_values.begin();
+	     it != known_values.end(); it++) {
+		if (wi->matcher->matches(*it)) {
+			wi->vid = *it;
+			wi->resolved = true;
+			return;
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// <queue_write>
+// Add a requested write, replacing any not yet sent for that value.
+// Called with g_mutex held.
+//-----------------------------------------------------------------------------
+static bool queue_write(const string &nstr, const string &vstr,
+			const string &value)
+{
+	uint32_t hid;
+	uint8_t nid, instance, ccid, index;
+	WriteInfo *wi;
+	string key;
+
+	if (!parse_znode(nstr, &hid, &nid)
+	    || !parse_vid(vstr, &instance, &ccid, &index))
+		return false;
+
+	key = write_key(hid, nid, instance, ccid, index);
+	if (!writes.count(key)) {
+		wi = new WriteInfo();
+		wi->matcher = new ValueMatcher(nstr, vstr);
+		resolve(wi);
+		writes[key] = wi;
+	}
+
+	wi = writes[key];
+	if (wi->pending)
+		pr_debug(2, "%s: %s superseded by %s\n", key.c_str(),
+			 wi->value.c_str(), value.c_str());
+	wi->value = value;
+	wi->pending = true;
+	pthread_cond_broadcast(&g_cond);
+
+	return true;
+}
+
+static NotificationDispatcher dispatcher(&g_mutex);
+
+//-----------------------------------------------------------------------------
+// Notification handlers, all called with g_mutex held
+//-----------------------------------------------------------------------------
+static void on_value_removed(ZWaveEvent const *ev)
+{
+	known_values.remove(ev->vid);
+	for (map<string, WriteInfo *>::iterator it = writes.begin();
+	     it != writes.end(); it++) {
+		if (it->second->resolved && (it->second->vid == ev->vid))
+			it->second->resolved = false;
+	}
+}
+
+static void on_value_added(ZWaveEvent const *ev)
+{
+	known_values.push_back(ev->vid);
+	for (map<string, WriteInfo *>::iterator it = writes.begin();
+	     it != writes.end(); it++) {
+		if (it->second->matcher->matches(ev->vid)) {
+			it->second->vid = ev->vid;
+			it->second->resolved = true;
+		}
+	}
+}
+
+// OpenZWave formats values its own way, so compare numbers as
+// numbers, and anything else regardless of case ("true" reads back
+// as "True")
+static bool value_matches(const string &value, const string &sent)
+{
+	char *vep, *sep;
+	double v, s;
+
+	v = strtod(value.c_str(), &vep);
+	s = strtod(sent.c_str(), &sep);
+	if (!value.empty() && !sent.empty() && !*vep && !*sep)
+		return v == s;
+
+	return strcasecmp(value.c_str(), sent.c_str()) == 0;
+}
+
+// Changed and refreshed values confirm a write, once the value
+// reads back as what we sent.  Anything else is a report from before
+// the write took effect.
+static void on_value_changed(ZWaveEvent const *ev)
+{
+	for (map<string, WriteInfo *>::iterator it = writes.begin();
+	     it != writes.end(); it++) {
+		WriteInfo *wi = it->second;
+		string value;
+
+		if (!wi->in_flight || !(wi->vid == ev->vid))
+			continue;
+
+		if (!Manager::Get()->GetValueAsString(wi->vid, &value)
+		    || !value_matches(value, wi->sent)) {
+			pr_debug(2, "%s: still %s, waiting for %s\n",
+				 it->first.c_str(), value.c_str(),
+				 wi->sent.c_str());
+			continue;
+		}
+
+		wi->in_flight = false;
+		if (verbose) {
+			printf("%s\t%s\t%s (%llums)\n", it->first.c_str(),
+			       wi->sent.c_str(), value.c_str(),
+			       (unsigned long long)(ozw_now_ns()
+						    - wi->sent_ns) / 1000000);
+		}
+		pthread_cond_broadcast(&g_cond);
+	}
+}
+
+static void on_driver_failed(ZWaveEvent const *ev)
+{
+	error("Driver failed");
+}
+
+static void on_scanned(ZWaveEvent const *ev)
+{
+	scanned = true;
+	pthread_cond_broadcast(&g_cond);
+}
+
+static void register_handlers(void)
+{
+	dispatcher.on(Notification::Type_ValueRemoved, on_value_removed);
+	dispatcher.on(Notification::Type_ValueAdded, on_value_added);
+	dispatcher.on(Notification::Type_ValueChanged, on_value_changed);
+	dispatcher.on(Notification::Type_ValueRefreshed, on_value_changed);
+	dispatcher.on(Notification::Type_DriverFailed, on_driver_failed);
+	dispatcher.on_scanned(on_scanned);
+}
+
+//-----------------------------------------------------------------------------
+// <read_input>
+// Thread streaming write requests from stdin.  The value is the rest
+// of the line, so it can have spaces in it.
+//-----------------------------------------------------------------------------
+static void *read_input(void *arg)
+{
+	char *line = NULL;
+	size_t len = 0;
+	char nstr[32], vstr[32];
+	string value;
+	int n = 0;
+
+	while (getline(&line, &len, stdin) != -1) {
+		if (sscanf(line, "%31s %31s %n", nstr, vstr, &n) != 2) {
+			fprintf(stderr, "Bad write request: %s", line);
+			continue;
+		}
+
+		value = line + n;
+		while (!value.empty() && isspace(value[value.size() - 1]))
+			value.erase(value.size() - 1);
+		if (value.empty()) {
+			fprintf(stderr, "Bad write request: %s", line);
+			continue;
+		}
+
+		pthread_mutex_lock(&g_mutex);
+		if (!queue_write(nstr, vstr, value))
+			fprintf(stderr, "Bad write request: %s", line);
+		pthread_mutex_unlock(&g_mutex);
+	}
+	free(line);
+
+	pthread_mutex_lock(&g_mutex);
+	input_done = true;
+	pthread_cond_broadcast(&g_cond);
+	pthread_mutex_unlock(&g_mutex);
+
+	return NULL;
+}
+
+void usage(void)
+{
+	fprintf(stderr,
+		"writeozw [-t timeout] " OZW_COMMON_USAGE "\n"
+		"        {<home-id>:<node-id> <instance>,<command class>,<index> <value>}...\n"
+		"With no writes given, they are read from stdin, one per line\n");
+	exit(1);
+}
+
+bool parse_options(int argc, char *argv[])
+{
+	char *ep;
+	int opt;
+	int i;
+
+	while ((opt = getopt(argc, argv, "dvt:" OZW_COMMON_OPTS)) != -1) {
+		switch (opt) {
+		case 'd':
+			debug++;
+			break;
+		case 'v':
+			verbose++;
+			break;
+		case 't':
+			timeout = strtoul(optarg, &ep, 0);
+			if (*ep)
+				usage();
+			break;
+		default:
+			if (!ozw_common_option(opt, optarg))
+				usage();
+		}
+	}
+
+	if ((argc - optind) % 3)
+		usage();
+
+	for (i = optind; i < argc; i += 3) {
+		if (!queue_write(argv[i], argv[i + 1], argv[i + 2]))
+			usage();
+	}
+
+	return optind == argc;
+}
+
+// Called with g_mutex held
+static map<string, WriteInfo *>::iterator
+find_pending(map<string, WriteInfo *>::iterator it)
+{
+	for (; it != writes.end(); it++) {
+		WriteInfo *wi = it->second;
+
+		if (!wi->pending)
+			continue;
+
+		if (wi->resolved)
+			break;
+
+		if (scanned) {
+			fprintf(stderr, "ERROR: Couldn't find value %s\n",
+				it->first.c_str());
+			wi->pending = false;
+			write_errors++;
+		}
+	}
+
+	return it;
+}
+
+//-----------------------------------------------------------------------------
+// <send_node>
+// Send all pending writes for the next node after 'last' which has
+// any.  Returns false if there was nothing to send.  Called with
+// g_mutex held.
+//-----------------------------------------------------------------------------
+static bool send_node(Manager *mgr, string &last)
+{
+	map<string, WriteInfo *>::iterator it;
+	string node;
+
+	// '~' sorts after anything in a key, so this skips to the
+	// first value of the following node
+	it = find_pending(writes.upper_bound(last + "~"));
+	if (it == writes.end())
+		it = find_pending(writes.begin());
+	if (it == writes.end())
+		return false;
+
+	node = node_of(it->first);
+	for (; (it != writes.end()) && (node_of(it->first) == node); it++) {
+		WriteInfo *wi = it->second;
+
+		if (!wi->pending || !wi->resolved)
+			continue;
+
+		pr_debug(1, "%s <- %s\n", it->first.c_str(), wi->value.c_str());
+
+		wi->pending = false;
+		wi->sent = wi->value;
+		wi->sent_ns = ozw_now_ns();
+		if (!mgr->SetValue(wi->vid, wi->sent)) {
+			fprintf(stderr, "ERROR: Unable to set %s to %s\n",
+				it->first.c_str(), wi->sent.c_str());
+			write_errors++;
+			continue;
+		}
+		wi->in_flight = true;
+	}
+
+	last = node;
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// <wait_confirm>
+// Wait until nothing is in flight, timing out any writes which
+// haven't been confirmed.  Called with g_mutex held.
+//-----------------------------------------------------------------------------
+static void wait_confirm(void)
+{
+	uint64_t deadline_ns = ozw_now_ns() + timeout * 1000000000ULL;
+	struct timespec deadline;
+	bool busy;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += timeout;
+
+	for (;;) {
+		busy = false;
+		for (map<string, WriteInfo *>::iterator it = writes.begin();
+		     it != writes.end(); it++) {
+			WriteInfo *wi = it->second;
+
+			if (!wi->in_flight)
+				continue;
+
+			if (ozw_now_ns() >= deadline_ns) {
+				fprintf(stderr, "ERROR: %s <- %s not confirmed\n",
+					it->first.c_str(), wi->sent.c_str());
+				wi->in_flight = false;
+				write_errors++;
+			} else {
+				busy = true;
+			}
+		}
+
+		if (!busy || failed)
+			return;
+
+		if (pthread_cond_timedwait(&g_cond, &g_mutex, &deadline)
+		    == ETIMEDOUT)
+			deadline_ns = 0;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// <main>
+// Create the driver and then wait
+//-----------------------------------------------------------------------------
+int main(int argc, char *argv[])
+{
+	Manager *mgr;
+	pthread_mutexattr_t mutexattr;
+	pthread_t input;
+	bool stdin_input;
+	string last;
+
+	pthread_mutexattr_init(&mutexattr);
+	pthread_mutexattr_settype(&mutexattr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&g_mutex, &mutexattr);
+	pthread_mutexattr_destroy(&mutexattr);
+
+	stdin_input = parse_options(argc, argv);
+
+	register_handlers();
+
+	mgr = ozw_setup(NotificationDispatcher::dispatch, &dispatcher);
+
+	// Only now, so it inherits the signal mask ozw_setup() set up
+	if (stdin_input)
+		pthread_create(&input, NULL, read_input, NULL);
+	else
+		input_done = true;
+
+	pr_debug(1, "Scanning Z-Wave network\n");
+
+	pthread_mutex_lock(&g_mutex);
+	while (!scanned && !failed) {
+		pthread_cond_wait(&g_cond, &g_mutex);
+	}
+
+	if (!failed)
+		pr_debug(1, "Z-Wave scan completed\n");
+
+	while (!failed) {
+		if (send_node(mgr, last)) {
+			wait_confirm();
+			continue;
+		}
+
+		if (input_done)
+			break;
+
+		pthread_cond_wait(&g_cond, &g_mutex);
+	}
+
+	pthread_mutex_unlock(&g_mutex);
+
+	ozw_cleanup(mgr);
+
+	pthread_mutex_destroy(&g_mutex);
+
+	if (failed || write_errors)
+		exit(1);
+
+	exit(0);
+}